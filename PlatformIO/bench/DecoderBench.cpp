@@ -0,0 +1,760 @@
+/*
+  Decoder throughput benchmark (env:bench).
+
+  Builds a corpus of pulse traces for every protocol in proto[] (random
+  codes, pulse length drift, jitter, receiver skew and noise glitches),
+  replays it through the receive interrupt and the decoder, and reports per
+  protocol and receive tolerance, without and with the learned calibration:
+    - ns per edge spent in handleInterrupt()
+    - ns per edge and per decoded frame spent in the decoder
+    - how many frames the protocols were tried on
+    - how many frames were decoded to a wrong code or protocol
+    - how many transmissions were decoded to the right code
+  The same is reported for transmissions of the classic rc-switch protocols
+  that are not in proto[] and for bursts of random pulses between repeating
+  gaps, every frame decoded from them is a false positive.
+
+  Usage: program [frames per protocol] [seed]
+         program windows [frames per protocol] [seed]
+         program roundtrip [transmissions per protocol] [seed]
+         program replay <capture file>
+         program learn <capture file>
+
+  The windows mode compares the per bit check of the decoder, the
+  precomputed PulseWindow, with the diff() against pulse length times
+  factor it replaced. Both classify the data bits of the same recorded
+  frames, the time per frame and the saving are reported.
+
+  The roundtrip mode generates transmissions of the classic rc-switch
+  protocols, feeds their frames to the ProtocolLearner and decodes the
+  same transmission with the learned protocol. It fails if a learned
+  protocol does not decode the code it was learned from, unless the
+  classic protocol itself decodes fewer than half of its transmissions.
+
+  The replay mode memory maps a capture recorded by the gateway (see
+  PulseCapture.h) and feeds every frame through the receiver again. The
+  learn mode derives protocols from the frames of a capture, see
+  ProtocolLearner.h.
+*/
+#include "Arduino.h"
+#include "HalSim.h"
+#include "RCSwitch.h"
+#include "PulseCapture.h"
+#include "ProtocolLearner.h"
+#include "PulseWindow.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <chrono>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <vector>
+
+static const uint8_t receivePin = 15;
+
+// Repeats per transmission, the decoder needs three to see two equal gaps
+static const unsigned int repeatsPerFrame = 4;
+static const unsigned int codeLength = 24;
+// Silence between two transmissions in microseconds
+static const unsigned int frameGap = 50000;
+
+// Transmitter pulse length error, relative
+static const double maxDrift = 0.05;
+// Jitter of every pulse half in microseconds
+static const double maxJitter = 60;
+// Receivers stretch high and shorten low levels by this many microseconds
+static const int receiverSkew = 40;
+// One in this many repeats contains a noise glitch
+static const unsigned int glitchRate = 40;
+
+static const int tolerances[] = { 20, 40, 60, 80 };
+
+// Classic rc-switch protocols 1 to 7. Except protocol 1, which is in
+// proto[], they are the foreign remotes of the corpus.
+static const RCSwitch::Protocol classicProtocols[] = {
+  { 350, {  1, 31 }, {  1,  3 }, {  3,  1 }, false, false, 0, 0, 1 },
+  { 650, {  1, 10 }, {  1,  2 }, {  2,  1 }, false, false, 0, 0, 1 },
+  { 100, { 30, 71 }, {  4, 11 }, {  9,  6 }, false, false, 0, 0, 1 },
+  { 380, {  1,  6 }, {  1,  3 }, {  3,  1 }, false, false, 0, 0, 1 },
+  { 500, {  6, 14 }, {  1,  2 }, {  2,  1 }, false, false, 0, 0, 1 },
+  { 450, { 23,  1 }, {  1,  2 }, {  2,  1 }, true, false, 0, 0, 1 },
+  { 150, {  2, 62 }, {  1,  6 }, {  6,  1 }, false, false, 0, 0, 1 },
+};
+
+static const unsigned int classicCount = sizeof(classicProtocols) / sizeof(classicProtocols[0]);
+
+// Repeats per transmission of the roundtrip mode, the learner needs three
+// equal frames and the decoder takes every second one
+static const unsigned int learnRepeats = 10;
+
+// Pulse halves of a noise burst in microseconds
+static const unsigned int minNoisePulse = 100;
+static const unsigned int maxNoisePulse = 1500;
+// Gap after a noise burst in microseconds, it repeats like a sync would
+static const unsigned int minNoiseGap = 5000;
+static const unsigned int maxNoiseGap = 20000;
+
+RCSwitch mySwitch = RCSwitch();
+
+static uint32_t randomState = 1;
+
+uint32_t nextRandom() {
+  // xorshift32, reproducible across platforms
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState;
+}
+
+// Uniform random number in [-1, 1]
+double randomUnit() {
+  return (nextRandom() / 4294967295.0) * 2.0 - 1.0;
+}
+
+struct Trace {
+  unsigned long code;
+  // pulse halves, starting with a high level
+  std::vector<unsigned int> durations;
+};
+
+/*
+ * Builds one transmission as a 433 MHz receiver would output it, with the
+ * transmitter drift, jitter, receiver skew and glitches configured above.
+ */
+Trace makeTrace(const RCSwitch::Protocol &protocol, unsigned int repeats = repeatsPerFrame) {
+  Trace trace;
+  trace.code = nextRandom() & ((1UL << codeLength) - 1);
+
+  RCSwitch::Waveform waveform;
+  mySwitch.setProtocol(protocol);
+  mySwitch.compileWaveform(trace.code, codeLength, waveform);
+
+  const double drift = 1.0 + maxDrift * randomUnit();
+
+  // Leading silence, the line is idle low before the first pulse
+  bool high = false;
+  unsigned long pending = frameGap;
+
+  for (unsigned int r = 0; r < repeats; r++) {
+    for (unsigned int i = 0; i < waveform.nEdges; i++) {
+      const bool pulseHigh = ((i & 1) == 0) != waveform.invertedSignal;
+      double duration = waveform.durations[i] * drift;
+      if (i == waveform.nGapEdge) {
+        duration += waveform.repeatTransmitDelay * 1000.0;
+      }
+      if (duration == 0) {
+        // merged into the neighbouring pulse half
+        continue;
+      }
+      duration += maxJitter * randomUnit() + (pulseHigh ? receiverSkew : -receiverSkew);
+
+      if (pulseHigh == high) {
+        pending += (unsigned long) duration;
+      } else {
+        trace.durations.push_back(pending);
+        high = pulseHigh;
+        pending = (unsigned long) duration;
+      }
+    }
+
+    if (nextRandom() % glitchRate == 0) {
+      // short glitch in the middle of the current pulse half
+      const unsigned long split = pending / 2;
+      trace.durations.push_back(split);
+      trace.durations.push_back(40);
+      pending -= split;
+    }
+  }
+  // Leave the line low after the transmission. A trailing low half merges
+  // into the leading silence of the next trace.
+  if (high) {
+    trace.durations.push_back(pending);
+  }
+
+  return trace;
+}
+
+/*
+ * Builds bursts of random pulse halves as a receiver outputs them without
+ * a transmitter, separated by gaps long enough to start a frame. The gap
+ * repeats within the tolerance of the receiver, so every burst after the
+ * first reaches the decoder.
+ */
+Trace makeNoise() {
+  Trace trace;
+  trace.code = 0;
+
+  const unsigned int gap = minNoiseGap + nextRandom() % (maxNoiseGap - minNoiseGap);
+  const unsigned int halves = 2 * (8 + nextRandom() % (2 * codeLength));
+
+  trace.durations.push_back(frameGap);
+  for (unsigned int r = 0; r < repeatsPerFrame; r++) {
+    // starts high after the gap, ends high before the next one
+    for (unsigned int i = 0; i < halves - 1; i++) {
+      trace.durations.push_back(minNoisePulse + nextRandom() % (maxNoisePulse - minNoisePulse));
+    }
+    trace.durations.push_back(gap + (unsigned int) (maxJitter * randomUnit()));
+  }
+  // leave the line low
+  trace.durations.push_back(minNoisePulse);
+  return trace;
+}
+
+struct Result {
+  unsigned long edges;
+  unsigned long attempts;
+  unsigned long decoded;
+  unsigned long wrong;
+  unsigned long correct;
+  unsigned long long isrNanos;
+  unsigned long long decoderNanos;
+};
+
+/*
+ * Replays traces of a protocol, or with protocol 0 foreign transmissions
+ * and noise, any code decoded from them is wrong.
+ */
+Result replay(const std::vector<Trace> &traces, int protocol) {
+  typedef std::chrono::steady_clock Clock;
+  Result result = { 0, 0, 0, 0, 0, 0, 0 };
+  const unsigned long attempts = mySwitch.getDecodeAttempts();
+
+  for (const Trace &trace : traces) {
+    bool found = false;
+    const unsigned int* durations = trace.durations.data();
+    unsigned int remaining = trace.durations.size();
+
+    while (remaining > 0) {
+      // stay well below the edge buffer size, as the main loop would
+      const unsigned int count = remaining < RCSWITCH_EDGE_BUFFER_SIZE / 2 ? remaining : RCSWITCH_EDGE_BUFFER_SIZE / 2;
+
+      Clock::time_point start = Clock::now();
+      hal::playPulses(receivePin, durations, count);
+      Clock::time_point played = Clock::now();
+      mySwitch.handleReceivedEdges();
+      Clock::time_point decoded = Clock::now();
+
+      result.isrNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(played - start).count();
+      result.decoderNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(decoded - played).count();
+      result.edges += count;
+      durations += count;
+      remaining -= count;
+    }
+
+    RCSwitch::ReceivedCode received;
+    while (mySwitch.readReceived(received)) {
+      result.decoded++;
+      if (protocol != 0 && received.value == trace.code && (int) received.protocol == protocol) {
+        found = true;
+      } else {
+        result.wrong++;
+      }
+    }
+    if (found) {
+      result.correct++;
+    }
+  }
+
+  result.attempts = mySwitch.getDecodeAttempts() - attempts;
+  return result;
+}
+
+// Passes over the frames per measurement of the windows mode
+static const unsigned int windowPasses = 20;
+
+/*
+ * Records the frames of a corpus as the decoder sees them: with a zero
+ * tolerance no protocol matches, so every frame ends up in the capture
+ * queue.
+ */
+std::vector<RCSwitch::CapturedFrame> recordFrames(const std::vector<Trace> &traces) {
+  std::vector<RCSwitch::CapturedFrame> frames;
+  RCSwitch::CapturedFrame frame;
+
+  mySwitch.setReceiveTolerance(0);
+  mySwitch.setCaptureUnknown(true);
+  for (const Trace &trace : traces) {
+    const unsigned int* durations = trace.durations.data();
+    unsigned int remaining = trace.durations.size();
+    while (remaining > 0) {
+      const unsigned int count = remaining < RCSWITCH_EDGE_BUFFER_SIZE / 2 ? remaining : RCSWITCH_EDGE_BUFFER_SIZE / 2;
+      hal::playPulses(receivePin, durations, count);
+      mySwitch.handleReceivedEdges();
+      while (mySwitch.readCaptured(frame)) {
+        frames.push_back(frame);
+      }
+      durations += count;
+      remaining -= count;
+    }
+  }
+  mySwitch.setCaptureUnknown(false);
+  return frames;
+}
+
+/* pulse length of a frame, measured on the sync pulse like the decoder does */
+static inline unsigned int frameDelay(const RCSwitch::CapturedFrame &frame, const RCSwitch::Protocol &pro) {
+  const unsigned int syncLengthInPulses = (pro.syncFactor.low > pro.syncFactor.high) ? pro.syncFactor.low : pro.syncFactor.high;
+  return frame.timings[pro.firstSyncTiming] / syncLengthInPulses;
+}
+
+static inline unsigned int diff(int A, int B) {
+  return abs(A - B);
+}
+
+/*
+ * The bit check the decoder used before the windows: every pulse half is
+ * compared with diff() against the pulse length times its factor.
+ */
+__attribute__((noinline)) bool decodeDiff(const RCSwitch::CapturedFrame &frame, const RCSwitch::Protocol &pro, int tolerance, unsigned long &code) {
+  const unsigned int delay = frameDelay(frame, pro);
+  const unsigned int delayTolerance = delay * tolerance / 100;
+
+  code = 0;
+  for (unsigned int i = pro.firstDataTiming; i < frame.count - 1; i += 2) {
+    code <<= 1;
+    if (diff(frame.timings[i], delay * pro.zero.high) < delayTolerance &&
+        diff(frame.timings[i + 1], delay * pro.zero.low) < delayTolerance) {
+      // zero
+    } else if (diff(frame.timings[i], delay * pro.one.high) < delayTolerance &&
+               diff(frame.timings[i + 1], delay * pro.one.low) < delayTolerance) {
+      code |= 1;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * The bit check of the decoder: the windows are built once per frame, every
+ * pulse half is a single unsigned compare.
+ */
+__attribute__((noinline)) bool decodeWindows(const RCSwitch::CapturedFrame &frame, const RCSwitch::Protocol &pro, int tolerance, unsigned long &code) {
+  const unsigned int delay = frameDelay(frame, pro);
+  const unsigned int delayTolerance = delay * tolerance / 100;
+
+  PulseWindow zeroHigh, zeroLow, oneHigh, oneLow;
+  zeroHigh.set(delay * pro.zero.high, delayTolerance);
+  zeroLow.set(delay * pro.zero.low, delayTolerance);
+  oneHigh.set(delay * pro.one.high, delayTolerance);
+  oneLow.set(delay * pro.one.low, delayTolerance);
+
+  code = 0;
+  for (unsigned int i = pro.firstDataTiming; i < frame.count - 1; i += 2) {
+    code <<= 1;
+    if (zeroHigh.matches(frame.timings[i]) && zeroLow.matches(frame.timings[i + 1])) {
+      // zero
+    } else if (oneHigh.matches(frame.timings[i]) && oneLow.matches(frame.timings[i + 1])) {
+      code |= 1;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* time stamp counter, 0 where the host has none */
+static inline unsigned long long readCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+struct CheckTime {
+  unsigned long long nanos;
+  unsigned long long cycles;
+  unsigned long decoded;
+};
+
+typedef bool (*DecodeCheck)(const RCSwitch::CapturedFrame &frame, const RCSwitch::Protocol &pro, int tolerance, unsigned long &code);
+
+CheckTime timeCheck(DecodeCheck check, const std::vector<RCSwitch::CapturedFrame> &frames, const RCSwitch::Protocol &pro, int tolerance) {
+  typedef std::chrono::steady_clock Clock;
+  CheckTime time = { 0, 0, 0 };
+  unsigned long code;
+
+  Clock::time_point start = Clock::now();
+  const unsigned long long startCycles = readCycles();
+  for (unsigned int pass = 0; pass < windowPasses; pass++) {
+    for (const RCSwitch::CapturedFrame &frame : frames) {
+      if (check(frame, pro, tolerance, code)) {
+        time.decoded++;
+      }
+    }
+  }
+  time.cycles = readCycles() - startCycles;
+  time.nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+  return time;
+}
+
+/*
+ * Times the diff() check against the PulseWindow check on the frames of
+ * every protocol and verifies that both classify every frame the same.
+ */
+int compareWindows(const std::vector<std::vector<Trace>> &corpus) {
+  const unsigned int protocolCount = corpus.size() - 1;
+  std::vector<std::vector<RCSwitch::CapturedFrame>> frames(protocolCount + 1);
+  for (unsigned int p = 1; p <= protocolCount; p++) {
+    frames[p] = recordFrames(corpus[p]);
+  }
+
+  printf("tolerance protocol  frames  diff ns/frame  windows ns/frame  saved ns/frame  diff cycles/frame  windows cycles/frame  saved cycles/frame  decoded  mismatches\n");
+
+  unsigned long mismatches = 0;
+  for (int tolerance : tolerances) {
+    for (unsigned int p = 1; p <= protocolCount; p++) {
+      RCSwitch::Protocol pro;
+      RCSwitch::getProtocol(p, pro);
+
+      unsigned long differing = 0;
+      for (const RCSwitch::CapturedFrame &frame : frames[p]) {
+        unsigned long diffCode, windowCode;
+        const bool diffDecoded = decodeDiff(frame, pro, tolerance, diffCode);
+        if (decodeWindows(frame, pro, tolerance, windowCode) != diffDecoded || (diffDecoded && diffCode != windowCode)) {
+          differing++;
+        }
+      }
+      mismatches += differing;
+
+      const CheckTime before = timeCheck(decodeDiff, frames[p], pro, tolerance);
+      const CheckTime after = timeCheck(decodeWindows, frames[p], pro, tolerance);
+      const double runs = (double) frames[p].size() * windowPasses;
+      printf("%8d%% %8u %7zu %14.1f %17.1f %15.1f %18.1f %21.1f %19.1f %8lu %11lu\n",
+        tolerance, p, frames[p].size(),
+        before.nanos / runs, after.nanos / runs, (before.nanos - (double) after.nanos) / runs,
+        before.cycles / runs, after.cycles / runs, (before.cycles - (double) after.cycles) / runs,
+        after.decoded / windowPasses, differing);
+    }
+  }
+
+  printf("\n%lu frames classified differently\n", mismatches);
+  return mismatches == 0 ? 0 : 1;
+}
+
+/*
+ * Memory maps a capture file, NULL if it cannot be read. Release it with
+ * munmap(data, size).
+ */
+void* mapCapture(const char* fileName, size_t &size) {
+  const int fd = open(fileName, O_RDONLY);
+  struct stat fileStat;
+  if (fd < 0 || fstat(fd, &fileStat) != 0) {
+    fprintf(stderr, "cannot open %s\n", fileName);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+
+  size = fileStat.st_size;
+  void* data = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "cannot map %s\n", fileName);
+    return NULL;
+  }
+
+  if (!PulseCaptureReader((const uint8_t*) data, size).isValid()) {
+    fprintf(stderr, "%s is not a pulse capture\n", fileName);
+    munmap(data, size);
+    return NULL;
+  }
+  return data;
+}
+
+/*
+ * Replays every frame of a capture file as a transmission of four repeats,
+ * terminated by the gap of a fifth, and reports what the decoder makes of it.
+ */
+int replayCapture(const char* fileName) {
+  typedef std::chrono::steady_clock Clock;
+
+  size_t size = 0;
+  void* data = mapCapture(fileName, size);
+  if (data == NULL) {
+    return 1;
+  }
+  PulseCaptureReader reader((const uint8_t*) data, size);
+
+  mySwitch.enableReceive(receivePin);
+
+  unsigned long frames = 0;
+  unsigned long decodedFrames = 0;
+  unsigned long edges = 0;
+  unsigned long long isrNanos = 0;
+  unsigned long long decoderNanos = 0;
+  std::vector<unsigned int> durations;
+
+  RCSwitch::CapturedFrame frame;
+  while (reader.next(frame)) {
+    frames++;
+
+    durations.clear();
+    for (unsigned int r = 0; r < repeatsPerFrame; r++) {
+      durations.insert(durations.end(), frame.timings, frame.timings + frame.count);
+    }
+    durations.push_back(frame.timings[0]);
+    if (durations.size() % 2 != 0) {
+      // leave the line low
+      durations.push_back(frameGap);
+    }
+
+    Clock::time_point start = Clock::now();
+    hal::playPulses(receivePin, durations.data(), durations.size());
+    Clock::time_point played = Clock::now();
+    mySwitch.handleReceivedEdges();
+    Clock::time_point decoded = Clock::now();
+
+    isrNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(played - start).count();
+    decoderNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(decoded - played).count();
+    edges += durations.size();
+
+    RCSwitch::ReceivedCode received;
+    bool found = false;
+    while (mySwitch.readReceived(received)) {
+      if (!found) {
+        printf("%lu ms: %u edges -> code %lu, %u bits, protocol %u, delay %u\n",
+          frame.timestamp, frame.count,
+          received.value, received.bitlength, received.protocol, received.delay);
+      }
+      found = true;
+    }
+    if (found) {
+      decodedFrames++;
+    } else {
+      printf("%lu ms: %u edges -> not decoded\n", frame.timestamp, frame.count);
+    }
+  }
+
+  printf("\n%lu frames, %lu decoded, isr %.1f ns/edge, decoder %.1f ns/edge\n",
+    frames, decodedFrames,
+    edges ? (double) isrNanos / edges : 0.0,
+    edges ? (double) decoderNanos / edges : 0.0);
+
+  munmap(data, size);
+  return 0;
+}
+
+/* prints a protocol in the format of receiver/protocols/set */
+void printProtocol(const RCSwitch::Protocol &p) {
+  printf("[%u, [%u, %u], [%u, %u], [%u, %u], %s, %s, %u, %u, %u]",
+    p.pulseLength, p.syncFactor.high, p.syncFactor.low,
+    p.zero.high, p.zero.low, p.one.high, p.one.low,
+    p.invertedSignal ? "true" : "false", p.sendEndBit ? "true" : "false",
+    p.repeatTransmitDelay, p.firstSyncTiming, p.firstDataTiming);
+}
+
+/*
+ * Feeds the frames of a capture file to the protocol learner and prints
+ * every protocol it derives, in the format of receiver/protocols/set.
+ */
+int learnCapture(const char* fileName) {
+  size_t size = 0;
+  void* data = mapCapture(fileName, size);
+  if (data == NULL) {
+    return 1;
+  }
+  PulseCaptureReader reader((const uint8_t*) data, size);
+
+  ProtocolLearner learner;
+  unsigned long frames = 0;
+  unsigned long learned = 0;
+  RCSwitch::CapturedFrame frame;
+  while (reader.next(frame)) {
+    frames++;
+    if (!learner.add(frame)) {
+      continue;
+    }
+
+    const ProtocolLearner::Result &result = learner.getResult();
+    printf("%lu ms: ", frame.timestamp);
+    printProtocol(result.protocol);
+    printf(" code %llu, %u bits, %u frames, skew %d\n",
+      (unsigned long long) result.code, result.bitLength, result.frames, result.skew);
+    learned++;
+    // the next protocol is learned from the following frames only
+    learner.begin();
+  }
+
+  printf("\n%lu frames, %lu protocols learned\n", frames, learned);
+
+  munmap(data, size);
+  return 0;
+}
+
+/* replays a transmission with a single protocol loaded, true if its code was decoded */
+bool decodesWith(const RCSwitch::Protocol &protocol, const std::vector<Trace> &traces) {
+  // used from the first handleReceivedEdges() of the replay
+  RCSwitch::loadProtocols(&protocol, 1);
+  mySwitch.setReceiveTolerance(60);
+  const bool decoded = replay(traces, 1).correct > 0;
+  RCSwitch::loadProtocols(NULL, 0);
+  mySwitch.handleReceivedEdges();
+  return decoded;
+}
+
+/*
+ * Learns the classic protocols from generated transmissions: the frames of
+ * every transmission are recorded, fed to a new learner and the same
+ * transmission is decoded again with the protocol learned from it. Every
+ * learned protocol has to read the right code. Where the classic protocol
+ * decodes at least half of its transmissions, the protocol has to be
+ * learned and every learned protocol has to decode its transmission; the
+ * others are too close to the receive tolerance and only reported.
+ */
+int learnRoundTrip(unsigned int transmissions) {
+  mySwitch.enableReceive(receivePin);
+
+  printf("protocol  decoded  learned  right code  learned decodes  checked  last learned protocol\n");
+  bool failed = false;
+  for (unsigned int c = 0; c < classicCount; c++) {
+    unsigned int decoded = 0;
+    unsigned int learned = 0;
+    unsigned int rightCodes = 0;
+    unsigned int learnedDecoded = 0;
+    RCSwitch::Protocol protocol = classicProtocols[c];
+
+    for (unsigned int t = 0; t < transmissions; t++) {
+      const std::vector<Trace> traces(1, makeTrace(classicProtocols[c], learnRepeats));
+      const bool originalDecodes = decodesWith(classicProtocols[c], traces);
+      if (originalDecodes) {
+        decoded++;
+      }
+
+      ProtocolLearner learner;
+      bool done = false;
+      for (const RCSwitch::CapturedFrame &frame : recordFrames(traces)) {
+        if (learner.add(frame)) {
+          done = true;
+          break;
+        }
+      }
+      if (!done) {
+        // glitches can leave fewer than three equal frames
+        continue;
+      }
+      learned++;
+
+      const ProtocolLearner::Result &result = learner.getResult();
+      protocol = result.protocol;
+      if (result.code == traces[0].code && result.bitLength == codeLength) {
+        rightCodes++;
+      }
+      if (decodesWith(protocol, traces)) {
+        learnedDecoded++;
+      }
+    }
+
+    const bool checked = decoded * 2 >= transmissions;
+    printf("%8u %8u %8u %11u %16u %8s  ", c + 1, decoded, learned, rightCodes, learnedDecoded, checked ? "yes" : "no");
+    printProtocol(protocol);
+    printf("\n");
+    failed |= rightCodes < learned;
+    failed |= checked && (learned == 0 || learnedDecoded < learned);
+  }
+
+  printf("\n%s\n", failed ? "FAILED" : "every learned protocol decodes its transmission");
+  return failed ? 1 : 0;
+}
+
+/* prints a row of the result table, without the success rate for foreign transmissions and noise */
+void printResult(int tolerance, bool calibrated, const char* name, const Result &r, size_t transmissions) {
+  printf("%8d%% %10s %8s %12.1f %16.1f %17.1f %9lu %8lu %6lu",
+    tolerance, calibrated ? "yes" : "no", name,
+    (double) r.isrNanos / r.edges,
+    (double) r.decoderNanos / r.edges,
+    r.decoded ? (double) r.decoderNanos / r.decoded : 0.0,
+    r.attempts, r.decoded, r.wrong);
+  if (transmissions > 0) {
+    printf(" %7.1f%%\n", 100.0 * r.correct / transmissions);
+  } else {
+    printf("       -\n");
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc > 2 && strcmp(argv[1], "replay") == 0) {
+    return replayCapture(argv[2]);
+  }
+  if (argc > 2 && strcmp(argv[1], "learn") == 0) {
+    return learnCapture(argv[2]);
+  }
+
+  const bool windows = argc > 1 && strcmp(argv[1], "windows") == 0;
+  const bool roundTrip = argc > 1 && strcmp(argv[1], "roundtrip") == 0;
+  if (windows || roundTrip) {
+    argc--;
+    argv++;
+  }
+
+  const unsigned int frames = (argc > 1) ? atoi(argv[1]) : 2000;
+  randomState = (argc > 2) ? atoi(argv[2]) : 1;
+
+  if (roundTrip) {
+    return learnRoundTrip((argc > 1) ? frames : 50);
+  }
+
+  mySwitch.enableReceive(receivePin);
+
+  const unsigned int protocolCount = RCSwitch::getProtocolCount();
+  std::vector<std::vector<Trace>> corpus(protocolCount + 1);
+  unsigned long edges = 0;
+  for (unsigned int p = 1; p <= protocolCount; p++) {
+    RCSwitch::Protocol protocol;
+    RCSwitch::getProtocol(p, protocol);
+    for (unsigned int i = 0; i < frames; i++) {
+      corpus[p].push_back(makeTrace(protocol));
+      edges += corpus[p].back().durations.size();
+    }
+  }
+
+  printf("%u transmissions x %u repeats per protocol, %lu edges\n\n", frames, repeatsPerFrame, edges);
+
+  if (windows) {
+    return compareWindows(corpus);
+  }
+
+  // Replayed after the protocols, so the calibrated runs see them with the learned windows
+  std::vector<Trace> foreign;
+  std::vector<Trace> noise;
+  for (unsigned int i = 0; i < frames; i++) {
+    foreign.push_back(makeTrace(classicProtocols[1 + i % (classicCount - 1)]));
+    noise.push_back(makeNoise());
+  }
+
+  printf("tolerance calibrated protocol  isr ns/edge  decoder ns/edge  ns/decoded frame  attempts  decoded  wrong  success\n");
+
+  for (int tolerance : tolerances) {
+    mySwitch.setReceiveTolerance(tolerance);
+    for (int calibrated = 0; calibrated <= 1; calibrated++) {
+      // every run learns from scratch
+      mySwitch.setCalibration(calibrated);
+      mySwitch.resetCalibration();
+      for (unsigned int p = 1; p <= protocolCount; p++) {
+        char name[12];
+        snprintf(name, sizeof(name), "%u", p);
+        printResult(tolerance, calibrated, name, replay(corpus[p], p), corpus[p].size());
+      }
+      printResult(tolerance, calibrated, "foreign", replay(foreign, 0), 0);
+      printResult(tolerance, calibrated, "noise", replay(noise, 0), 0);
+    }
+  }
+
+  printf("\nlearned at %d%%: protocol  pulse length  high offset  low offset  jitter  frames\n", tolerances[sizeof(tolerances) / sizeof(tolerances[0]) - 1]);
+  for (unsigned int p = 1; p <= protocolCount; p++) {
+    RCSwitch::Calibration calibration;
+    mySwitch.getCalibration(p, calibration);
+    printf("%24u %13u %12d %11d %7u %7lu\n", p, calibration.pulseLength,
+      calibration.highOffset, calibration.lowOffset, calibration.jitter, calibration.frames);
+  }
+
+  printf("\nedge overruns: %lu, dropped codes: %lu\n", mySwitch.getEdgeOverruns(), mySwitch.getDroppedCodes());
+  return 0;
+}
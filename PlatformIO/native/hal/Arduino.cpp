@@ -0,0 +1,99 @@
+#include "Arduino.h"
+#include "HalSim.h"
+
+#include <stdio.h>
+
+static const unsigned int numPins = 64;
+
+static unsigned long simMicros = 0;
+static uint8_t pinLevels[numPins];
+static void (*pinInterrupts[numPins])(void);
+static void (*writeHook)(uint8_t pin, uint8_t level, unsigned long time) = NULL;
+
+HardwareSerial Serial;
+
+unsigned long micros() {
+  return simMicros;
+}
+
+unsigned long millis() {
+  return simMicros / 1000;
+}
+
+void delay(unsigned long ms) {
+  simMicros += ms * 1000;
+}
+
+void delayMicroseconds(unsigned int us) {
+  simMicros += us;
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  (void) pin;
+  (void) mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+  if (pin < numPins) {
+    pinLevels[pin] = val;
+  }
+  if (writeHook) {
+    writeHook(pin, val, simMicros);
+  }
+}
+
+int digitalRead(uint8_t pin) {
+  return (pin < numPins) ? pinLevels[pin] : LOW;
+}
+
+void attachInterrupt(uint8_t interrupt, void (*isr)(void), int mode) {
+  (void) mode;
+  if (interrupt < numPins) {
+    pinInterrupts[interrupt] = isr;
+  }
+}
+
+void detachInterrupt(uint8_t interrupt) {
+  if (interrupt < numPins) {
+    pinInterrupts[interrupt] = NULL;
+  }
+}
+
+size_t Print::print(const char* s) { return printf("%s", s); }
+size_t Print::print(char c) { return printf("%c", c); }
+size_t Print::print(int n) { return printf("%d", n); }
+size_t Print::print(unsigned int n) { return printf("%u", n); }
+size_t Print::print(long n) { return printf("%ld", n); }
+size_t Print::print(unsigned long n) { return printf("%lu", n); }
+size_t Print::print(unsigned long long n) { return printf("%llu", n); }
+size_t Print::print(double n) { return printf("%.2f", n); }
+size_t Print::println() { return printf("\n"); }
+
+namespace hal {
+
+  void advanceMicros(unsigned long us) {
+    simMicros += us;
+  }
+
+  void setPinLevel(uint8_t pin, int level) {
+    if (pin >= numPins || pinLevels[pin] == level) {
+      return;
+    }
+    pinLevels[pin] = level;
+    if (pinInterrupts[pin]) {
+      pinInterrupts[pin]();
+    }
+  }
+
+  void playPulses(uint8_t pin, const unsigned int* durations, unsigned int count) {
+    for (unsigned int i = 0; i < count; i++) {
+      simMicros += durations[i];
+      setPinLevel(pin, !digitalRead(pin));
+    }
+  }
+
+  void setWriteHook(void (*hook)(uint8_t pin, uint8_t level, unsigned long time)) {
+    writeHook = hook;
+  }
+
+}
@@ -0,0 +1,74 @@
+/*
+  Minimal Arduino API for host (env:native) builds.
+
+  Only what RCSwitch and the gateway queue logic use is provided. Time is
+  simulated: micros()/millis() return the simulated clock, delay() and
+  delayMicroseconds() advance it. Pin levels and interrupts are driven
+  through the functions in HalSim.h.
+*/
+#ifndef _Arduino_h
+#define _Arduino_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT  0x01
+#define OUTPUT 0x03
+
+#define RISING  0x01
+#define FALLING 0x02
+#define CHANGE  0x03
+
+#define LED_BUILTIN 13
+
+#define PROGMEM
+#define memcpy_P(dest, src, num) memcpy((dest), (src), (num))
+#define F(string_literal) (string_literal)
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+unsigned long micros();
+unsigned long millis();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+// On the ESP32 the interrupt number is the pin number
+void attachInterrupt(uint8_t interrupt, void (*isr)(void), int mode);
+void detachInterrupt(uint8_t interrupt);
+
+class Print {
+  public:
+    size_t print(const char* s);
+    size_t print(char c);
+    size_t print(int n);
+    size_t print(unsigned int n);
+    size_t print(long n);
+    size_t print(unsigned long n);
+    size_t print(unsigned long long n);
+    size_t print(double n);
+    size_t println();
+    template<typename T> size_t println(T value) {
+      size_t n = print(value);
+      return n + println();
+    }
+};
+
+class HardwareSerial : public Print {
+  public:
+    void begin(unsigned long baud) { (void) baud; }
+};
+
+extern HardwareSerial Serial;
+
+#endif
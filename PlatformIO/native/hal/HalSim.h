@@ -0,0 +1,26 @@
+/*
+  Simulation controls of the host hardware abstraction.
+*/
+#ifndef _HalSim_h
+#define _HalSim_h
+
+#include "Arduino.h"
+
+namespace hal {
+
+  // Advances the simulated clock
+  void advanceMicros(unsigned long us);
+
+  // Sets the level of an input pin, calling its interrupt handler on a change
+  void setPinLevel(uint8_t pin, int level);
+
+  // Plays pulse durations on an input pin: each duration is held at the
+  // current level, then the level toggles
+  void playPulses(uint8_t pin, const unsigned int* durations, unsigned int count);
+
+  // Called on every digitalWrite(), e.g. to record the transmitted waveform
+  void setWriteHook(void (*hook)(uint8_t pin, uint8_t level, unsigned long time));
+
+}
+
+#endif
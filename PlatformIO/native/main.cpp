@@ -0,0 +1,155 @@
+/*
+  Host simulation of the gateway loop (env:native).
+
+  Reads commands from stdin, one per line:
+    send <code> <length> <protocol> <repeatTransmit> [priority] [stateMask]
+                                                       queue a code for sending, priority 0-2
+    receive <code> <length> <protocol> <repeats>       play a transmission on the receiver pin
+    dedup <holdOff> [pressInfo]                        merge the frames of a press, 0 publishes every frame,
+                                                       pressInfo 1 also publishes every ended press
+    run <milliseconds>                                 run the gateway loop
+  and prints what the ESP32 would publish and transmit.
+*/
+#include "Arduino.h"
+#include "HalSim.h"
+#include "RCSwitch.h"
+#include "Gateway.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static const uint8_t receivePin = 15;
+static const uint8_t transmitPin = 32;
+
+// Simulated time per loop() iteration
+static const unsigned long loopMicros = 100;
+// Same default as the gateway
+static const unsigned long defaultHoldOff = 300;
+
+RCSwitch mySwitch = RCSwitch();
+ReceiveDeduplicator receiveDedup;
+
+static unsigned long transmitStart = 0;
+static unsigned int transmitEdges = 0;
+
+void recordTransmit(uint8_t pin, uint8_t level, unsigned long time) {
+  (void) level;
+  if (pin != transmitPin) {
+    return;
+  }
+  if (transmitEdges == 0) {
+    transmitStart = time;
+  }
+  transmitEdges++;
+}
+
+void publishReceivedCode(const RCSwitch::ReceivedCode &code) {
+  printf("publish codereceived %llu (protocol %u, %u bits, delay %u)\n", (unsigned long long) code.value, code.protocol, code.bitlength, code.delay);
+}
+
+void publishPress(const ReceiveDeduplicator::Press &press) {
+  printf("publish press %llu (protocol %u, %u bits, %u repeats, %lu ms)\n", (unsigned long long) press.code.value, press.code.protocol, press.code.bitlength, press.repeats, press.duration);
+}
+
+// Only the first frame of a press is published, as by the gateway
+void forwardReceivedCode(const RCSwitch::ReceivedCode &code) {
+  if (receiveDedup.receive(code)) {
+    publishReceivedCode(code);
+  }
+}
+
+void gatewayLoop() {
+  dispatchReceivedCodes(mySwitch, forwardReceivedCode);
+  receiveDedup.handleEndedPresses(millis());
+
+  if (transmitEdges > 0 && !mySwitch.isTransmitting()) {
+    printf("transmitted %u edges in %lu us\n", transmitEdges, micros() - transmitStart);
+    transmitEdges = 0;
+  }
+
+  if (sendQueuedCode(mySwitch)) {
+    printf("publish queuelength %u\n", scheduler.count());
+  }
+
+  hal::advanceMicros(loopMicros);
+}
+
+// Plays 'repeats' transmissions of code on the receiver pin, as a remote would send them
+void playTransmission(RCSwitch::CodeValue code, unsigned int length, int protocol, int repeats) {
+  // A second RCSwitch instance would reset the receiver, sendQueuedCode() sets the protocol again anyway
+  RCSwitch::Waveform waveform;
+  mySwitch.setProtocol(protocol);
+  mySwitch.compileWaveform(code, length, waveform);
+
+  // Merge pulse halves of zero length into their neighbours
+  static unsigned int pulses[RCSWITCH_MAX_WAVEFORM_EDGES];
+  unsigned int count = 0;
+  bool merge = false;
+  for (unsigned int i = 0; i < waveform.nEdges; i++) {
+    unsigned int duration = waveform.durations[i];
+    if (i == waveform.nGapEdge) {
+      duration += waveform.repeatTransmitDelay * 1000;
+    }
+    if (duration == 0) {
+      merge = true;
+    } else if (merge && count > 0) {
+      pulses[count - 1] += duration;
+      merge = false;
+    } else {
+      // a leading zero half has nothing to merge into, the level accounts for it
+      pulses[count++] = duration;
+      merge = false;
+    }
+  }
+
+  // The first pulse half is high, unless the leading halves were merged away
+  const bool leadingMerged = waveform.durations[0] == 0;
+  hal::setPinLevel(receivePin, (waveform.invertedSignal != leadingMerged) ? LOW : HIGH);
+  for (int i = 0; i < repeats; i++) {
+    hal::playPulses(receivePin, pulses, count);
+    // The RF task drains the edge buffer while the remote is still sending,
+    // a whole transmission of a wide code would not fit into it
+    mySwitch.handleReceivedEdges();
+  }
+}
+
+int main() {
+  hal::setWriteHook(recordTransmit);
+
+  mySwitch.enableReceive(receivePin);
+  mySwitch.enableTransmit(transmitPin);
+  receiveDedup.setHoldOff(defaultHoldOff);
+
+  char line[128];
+  while (fgets(line, sizeof(line), stdin)) {
+    unsigned long long code;
+    unsigned int length;
+    int protocol, repeats;
+    int priority = PRIORITY_NORMAL;
+    unsigned long long stateMask = 0;
+    unsigned long milliseconds;
+    int pressInfo = 0;
+
+    if (sscanf(line, "send %llu %u %d %d %d %llx", &code, &length, &protocol, &repeats, &priority, &stateMask) >= 4) {
+      if (!isValidSendCommand(length, protocol)) {
+        printf("invalid send command\n");
+      } else if (!queueCode(code, length, protocol, repeats, priority, stateMask)) {
+        printf("send queue full\n");
+      }
+    } else if (sscanf(line, "receive %llu %u %d %d", &code, &length, &protocol, &repeats) == 4) {
+      playTransmission(code, length, protocol, repeats);
+    } else if (sscanf(line, "dedup %lu %d", &milliseconds, &pressInfo) >= 1) {
+      receiveDedup.setHoldOff(milliseconds);
+      receiveDedup.setPressHandler(pressInfo ? publishPress : NULL);
+    } else if (sscanf(line, "run %lu", &milliseconds) == 1) {
+      const unsigned long start = millis();
+      while (millis() - start < milliseconds) {
+        gatewayLoop();
+      }
+    } else if (line[0] != '\n' && line[0] != '#') {
+      printf("unknown command: %s", line);
+    }
+  }
+
+  return 0;
+}
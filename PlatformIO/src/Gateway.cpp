@@ -0,0 +1,516 @@
+#include "Gateway.h"
+
+SendScheduler scheduler;
+
+/* helper function for the target index, true if both items address the same device */
+static bool sameTarget(const CodeQueueItem &a, const CodeQueueItem &b) {
+  return a.stateMask == b.stateMask &&
+         (a.code & ~a.stateMask) == (b.code & ~b.stateMask) &&
+         a.length == b.length &&
+         a.protocol == b.protocol;
+}
+
+/* helper function for the target index, bucket of the item's target */
+static unsigned int targetHash(const CodeQueueItem &item) {
+#if RCSWITCH_MAX_CODE_BITS > 32
+  const uint64_t address = item.code & ~item.stateMask;
+  const uint32_t key = (uint32_t) (address ^ (address >> 32)) ^ ((uint32_t) item.length << 24) ^ ((uint32_t) item.protocol << 16);
+#else
+  const uint32_t key = (item.code & ~item.stateMask) ^ ((uint32_t) item.length << 24) ^ ((uint32_t) item.protocol << 16);
+#endif
+  // Fibonacci hashing, the top bits are the best mixed
+  return (uint32_t) (key * 2654435761u) >> (32 - queueIndexBits);
+}
+
+CodeQueue::CodeQueue() {
+  this->nHead = 0;
+  this->nCount = 0;
+  this->nHighWaterMark = 0;
+  this->nOverflows = 0;
+  this->nCoalesced = 0;
+  memset(this->index, -1, sizeof(this->index));
+}
+
+/*
+ * Position in the target index of the item queued for the same target as
+ * item, or of the free bucket where it would be inserted.
+ */
+unsigned int CodeQueue::findIndex(const CodeQueueItem &item) const {
+  unsigned int i = targetHash(item);
+  while (this->index[i] >= 0 && !sameTarget(this->items[this->index[i]], item)) {
+    i = (i + 1) & (queueIndexSize - 1);
+  }
+  return i;
+}
+
+/*
+ * Removes the index entry at position i. Later entries of the probe
+ * sequence are shifted back, so lookups never need tombstones.
+ */
+void CodeQueue::removeIndex(unsigned int i) {
+  unsigned int j = i;
+  for (;;) {
+    this->index[i] = -1;
+    for (;;) {
+      j = (j + 1) & (queueIndexSize - 1);
+      if (this->index[j] < 0) {
+        return;
+      }
+      const unsigned int home = targetHash(this->items[this->index[j]]);
+      // the entry at j can fill the hole if its home bucket is not in (i, j]
+      const bool between = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+      if (!between) {
+        break;
+      }
+    }
+    this->index[i] = this->index[j];
+    i = j;
+  }
+}
+
+/*
+ * Replaces a queued item for the same target, keeping its place in the
+ * queue. false if there is none.
+ */
+bool CodeQueue::coalesce(const CodeQueueItem &item, unsigned int position) {
+  if (this->index[position] < 0) {
+    return false;
+  }
+
+  CodeQueueItem &queued = this->items[this->index[position]];
+  queued.code = item.code;
+  queued.repeatTransmit = item.repeatTransmit;
+  this->nCoalesced++;
+  return true;
+}
+
+bool CodeQueue::push(const CodeQueueItem &item) {
+  const unsigned int position = this->findIndex(item);
+  if (this->coalesce(item, position)) {
+    return true;
+  }
+
+  if (this->nCount == maxQueueCount) {
+    this->nOverflows++;
+    return false;
+  }
+
+  unsigned int tail = this->nHead + this->nCount;
+  if (tail >= maxQueueCount) {
+    tail -= maxQueueCount;
+  }
+  this->items[tail] = item;
+  this->index[position] = tail;
+
+  this->nCount++;
+  if (this->nCount > this->nHighWaterMark) {
+    this->nHighWaterMark = this->nCount;
+  }
+  return true;
+}
+
+bool CodeQueue::pushFront(const CodeQueueItem &item) {
+  const unsigned int position = this->findIndex(item);
+  if (this->index[position] >= 0) {
+    // A newer command for the same target is already queued, it wins
+    this->nCoalesced++;
+    return true;
+  }
+
+  if (this->nCount == maxQueueCount) {
+    this->nOverflows++;
+    return false;
+  }
+
+  this->nHead = (this->nHead == 0) ? maxQueueCount - 1 : this->nHead - 1;
+  this->items[this->nHead] = item;
+  this->index[position] = this->nHead;
+
+  this->nCount++;
+  if (this->nCount > this->nHighWaterMark) {
+    this->nHighWaterMark = this->nCount;
+  }
+  return true;
+}
+
+bool CodeQueue::pop(CodeQueueItem &item) {
+  if (this->nCount == 0) {
+    return false;
+  }
+
+  item = this->items[this->nHead];
+  this->removeIndex(this->findIndex(item));
+
+  this->nHead++;
+  if (this->nHead == maxQueueCount) {
+    this->nHead = 0;
+  }
+  this->nCount--;
+  return true;
+}
+
+SendScheduler::SendScheduler() {
+  this->nHighWaterMark = 0;
+  for (unsigned int i = 0; i < priorityCount; i++) {
+    this->nSent[i] = 0;
+    this->nTotalWait[i] = 0;
+    this->nMaxWait[i] = 0;
+  }
+}
+
+bool SendScheduler::push(const CodeQueueItem &item) {
+  if (!this->queues[item.priority].push(item)) {
+    return false;
+  }
+
+  const unsigned int total = this->count();
+  if (total > this->nHighWaterMark) {
+    this->nHighWaterMark = total;
+  }
+  return true;
+}
+
+bool SendScheduler::pushFront(const CodeQueueItem &item) {
+  return this->queues[item.priority].pushFront(item);
+}
+
+bool SendScheduler::pop(CodeQueueItem &item) {
+  const int priority = this->highestPriority();
+  if (priority < 0 || !this->queues[priority].pop(item)) {
+    return false;
+  }
+
+  const unsigned long wait = millis() - item.queuedAt;
+  this->nSent[priority]++;
+  this->nTotalWait[priority] += wait;
+  if (wait > this->nMaxWait[priority]) {
+    this->nMaxWait[priority] = wait;
+  }
+  return true;
+}
+
+int SendScheduler::highestPriority() const {
+  for (int i = priorityCount - 1; i >= 0; i--) {
+    if (!this->queues[i].isEmpty()) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+unsigned int SendScheduler::count() const {
+  unsigned int total = 0;
+  for (unsigned int i = 0; i < priorityCount; i++) {
+    total += this->queues[i].count();
+  }
+  return total;
+}
+
+unsigned long SendScheduler::getOverflows() const {
+  unsigned long overflows = 0;
+  for (unsigned int i = 0; i < priorityCount; i++) {
+    overflows += this->queues[i].getOverflows();
+  }
+  return overflows;
+}
+
+unsigned long SendScheduler::getCoalesced() const {
+  unsigned long coalesced = 0;
+  for (unsigned int i = 0; i < priorityCount; i++) {
+    coalesced += this->queues[i].getCoalesced();
+  }
+  return coalesced;
+}
+
+unsigned long SendScheduler::getAverageWait(unsigned int priority) const {
+  return this->nSent[priority] ? this->nTotalWait[priority] / this->nSent[priority] : 0;
+}
+
+void initQueueItem(CodeQueueItem &item, RCSwitch::CodeValue code, unsigned int length, int protocol, int repeatTransmit, int priority, RCSwitch::CodeValue stateMask) {
+  if (priority < PRIORITY_LOW || priority > PRIORITY_HIGH) {
+    priority = PRIORITY_NORMAL;
+  }
+
+  item.code = code;
+  item.length = length;
+  item.protocol = protocol;
+  item.repeatTransmit = repeatTransmit;
+  item.priority = priority;
+  item.stateMask = stateMask;
+  item.queuedAt = millis();
+}
+
+bool isValidSendCommand(unsigned int codeLength, int protocol) {
+  return codeLength > 0 && codeLength <= RCSWITCH_MAX_CODE_BITS &&
+         protocol > 0 && (unsigned int) protocol <= RCSwitch::getProtocolCount();
+}
+
+bool queueCode(RCSwitch::CodeValue code, unsigned int length, int protocol, int repeatTransmit, int priority, RCSwitch::CodeValue stateMask) {
+  CodeQueueItem item;
+  initQueueItem(item, code, length, protocol, repeatTransmit, priority, stateMask);
+
+  if (!scheduler.push(item)) {
+    #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+      Serial.println(F("Error: Send queue is full!"));
+    #endif
+    return false;
+  }
+  return true;
+}
+
+bool queueCodes(const CodeQueueItem* items, unsigned int count) {
+  // Only queue the batch if every item fits, even if none of them coalesces
+  unsigned int needed[priorityCount] = { 0 };
+  for (unsigned int i = 0; i < count; i++) {
+    needed[items[i].priority]++;
+  }
+  for (unsigned int priority = 0; priority < priorityCount; priority++) {
+    if (needed[priority] > maxQueueCount - scheduler.count(priority)) {
+      #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+        Serial.println(F("Error: Send queue is full!"));
+      #endif
+      return false;
+    }
+  }
+
+  for (unsigned int i = 0; i < count; i++) {
+    scheduler.push(items[i]);
+  }
+  return true;
+}
+
+unsigned int readBinaryCommands(const uint8_t* payload, unsigned int length, CodeQueueItem* items, unsigned int maxCount) {
+  const unsigned int count = length / binaryCommandSize;
+  if (length % binaryCommandSize != 0 || count == 0 || count > maxCount) {
+    return 0;
+  }
+
+  for (unsigned int i = 0; i < count; i++) {
+    const uint8_t* record = payload + i * binaryCommandSize;
+    const unsigned long code = (unsigned long) record[0] | ((unsigned long) record[1] << 8) |
+                               ((unsigned long) record[2] << 16) | ((unsigned long) record[3] << 24);
+    const unsigned int codeLength = record[4];
+    const int protocol = record[5];
+    const unsigned int priority = record[7];
+
+    // The records only have room for 32 bit codes
+    if (codeLength > 32 || !isValidSendCommand(codeLength, protocol) || priority > PRIORITY_HIGH) {
+      return 0;
+    }
+    initQueueItem(items[i], code, codeLength, protocol, record[6], priority);
+  }
+  return count;
+}
+
+// The code on air, whether it was asked to stop for a more urgent one and
+// whether it may be, see sendQueuedCode()
+static CodeQueueItem sendingItem;
+static bool preempting = false;
+static bool preemptable = false;
+
+/* helper function for sendQueuedCode, puts an item on air */
+static void startSending(RCSwitch &rcSwitch, const CodeQueueItem &item) {
+  #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+    Serial.print(F("sending code: "));
+    Serial.print(item.code);
+    Serial.print(F(" length: "));
+    Serial.print(item.length);
+    Serial.print(F(" protocol: "));
+    Serial.print(item.protocol);
+    Serial.print(F(" repeatTransmit: "));
+    Serial.print(item.repeatTransmit);
+    Serial.print(F(" priority: "));
+    Serial.println(item.priority);
+  #endif
+
+  rcSwitch.setProtocol(item.protocol);
+  rcSwitch.setRepeatTransmit(item.repeatTransmit);
+  rcSwitch.sendAsync(item.code, item.length);
+  sendingItem = item;
+}
+
+bool sendQueuedCode(RCSwitch &rcSwitch) {
+  // The transmission runs in the background, only start the next one when the radio is free
+  if (rcSwitch.isTransmitting()) {
+    if (!preempting && preemptable && scheduler.highestPriority() > sendingItem.priority) {
+      #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+        Serial.print(F("preempting code: "));
+        Serial.println(sendingItem.code);
+      #endif
+      rcSwitch.stopTransmitAfterRepeat();
+      preempting = true;
+    }
+    return false;
+  }
+
+  if (preempting) {
+    preempting = false;
+
+    const int skippedRepeats = rcSwitch.getSkippedRepeats();
+    if (skippedRepeats > 0) {
+      // Resume the remaining repeats once the more urgent codes are out
+      CodeQueueItem remaining = sendingItem;
+      remaining.repeatTransmit = skippedRepeats;
+      remaining.queuedAt = millis();
+      if (!scheduler.pushFront(remaining)) {
+        // Its queue filled up meanwhile (counted as an overflow), rather
+        // than losing the remaining repeats, finish the code first
+        #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+          Serial.println(F("Error: Send queue is full, finishing the preempted code"));
+        #endif
+        startSending(rcSwitch, remaining);
+        preemptable = false;
+        return true;
+      }
+    }
+  }
+
+  CodeQueueItem item;
+  if (!scheduler.pop(item)) {
+    return false;
+  }
+
+  startSending(rcSwitch, item);
+  preemptable = true;
+  return true;
+}
+
+int preemptablePriority(RCSwitch &rcSwitch) {
+  // a stopped code is only queued again by the next sendQueuedCode()
+  return (preempting || (preemptable && rcSwitch.isTransmitting())) ? sendingItem.priority : -1;
+}
+
+EventBuffer::EventBuffer() {
+  this->nHead = 0;
+  this->nCount = 0;
+  this->nHighWaterMark = 0;
+  this->nDropped = 0;
+}
+
+void EventBuffer::push(const RCSwitch::ReceivedCode &code) {
+  if (this->isFull()) {
+    this->pop();
+    this->nDropped++;
+  }
+
+  unsigned int tail = this->nHead + this->nCount;
+  if (tail >= maxPendingEvents) {
+    tail -= maxPendingEvents;
+  }
+  this->codes[tail] = code;
+
+  this->nCount++;
+  if (this->nCount > this->nHighWaterMark) {
+    this->nHighWaterMark = this->nCount;
+  }
+}
+
+bool EventBuffer::peek(RCSwitch::ReceivedCode &code) const {
+  if (this->nCount == 0) {
+    return false;
+  }
+  code = this->codes[this->nHead];
+  return true;
+}
+
+void EventBuffer::pop() {
+  if (this->nCount == 0) {
+    return;
+  }
+
+  this->nHead++;
+  if (this->nHead == maxPendingEvents) {
+    this->nHead = 0;
+  }
+  this->nCount--;
+}
+
+ReceiveDeduplicator::ReceiveDeduplicator() {
+  this->nActive = 0;
+  this->nHoldOff = 0;
+  this->pressHandler = NULL;
+  this->nFrames = 0;
+  this->nSuppressed = 0;
+}
+
+/* Reports the press at i and removes it, the order of the others does not matter */
+void ReceiveDeduplicator::endPress(unsigned int i) {
+  if (this->pressHandler != NULL) {
+    this->pressHandler(this->presses[i]);
+  }
+
+  this->nActive--;
+  this->presses[i] = this->presses[this->nActive];
+  this->lastFrame[i] = this->lastFrame[this->nActive];
+}
+
+bool ReceiveDeduplicator::receive(const RCSwitch::ReceivedCode &code) {
+  this->nFrames++;
+  if (this->nHoldOff == 0) {
+    return true;
+  }
+
+  for (unsigned int i = 0; i < this->nActive; i++) {
+    const RCSwitch::ReceivedCode &first = this->presses[i].code;
+    if (first.value == code.value && first.protocol == code.protocol && first.bitlength == code.bitlength &&
+        code.timestamp - this->lastFrame[i] <= this->nHoldOff) {
+      this->presses[i].repeats++;
+      this->presses[i].duration = code.timestamp - first.timestamp;
+      this->lastFrame[i] = code.timestamp;
+      this->nSuppressed++;
+      return false;
+    }
+  }
+
+  if (this->nActive == maxActivePresses) {
+    // End the press that has been quiet for the longest time
+    unsigned int oldest = 0;
+    for (unsigned int i = 1; i < this->nActive; i++) {
+      if ((long) (this->lastFrame[i] - this->lastFrame[oldest]) < 0) {
+        oldest = i;
+      }
+    }
+    this->endPress(oldest);
+  }
+
+  Press &press = this->presses[this->nActive];
+  press.code = code;
+  press.repeats = 0;
+  press.duration = 0;
+  this->lastFrame[this->nActive] = code.timestamp;
+  this->nActive++;
+  return true;
+}
+
+void ReceiveDeduplicator::handleEndedPresses(unsigned long now) {
+  unsigned int i = 0;
+  while (i < this->nActive) {
+    if ((long) (now - this->lastFrame[i]) > (long) this->nHoldOff) {
+      // endPress() moves the last press to i
+      this->endPress(i);
+    } else {
+      i++;
+    }
+  }
+}
+
+void dispatchReceivedCodes(RCSwitch &rcSwitch, void (*publish)(const RCSwitch::ReceivedCode &code)) {
+  // Publish every code decoded since the last call, not just the latest one
+  RCSwitch::ReceivedCode received;
+  rcSwitch.handleReceivedEdges();
+  while (rcSwitch.readReceived(received)) {
+    if (received.value == 0) {
+      #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+        Serial.println(F("Unknown encoding"));
+      #endif
+    } else {
+      publish(received);
+      #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+        Serial.print(F("code received "));
+        Serial.print(received.value);
+        Serial.print(F(" protocol: "));
+        Serial.println(received.protocol);
+      #endif
+    }
+  }
+}
@@ -0,0 +1,248 @@
+/*
+  Send queue and receive dispatch of the gateway.
+
+  This is the part of the gateway loop that only depends on RCSwitch, so it
+  builds for the ESP32 as well as for the host (env:native). MQTT, WiFi and
+  configuration stay in main.cpp.
+*/
+#ifndef _Gateway_h
+#define _Gateway_h
+
+#include "Arduino.h"
+#include "RCSwitch.h"
+
+// Priority classes of queued codes, higher classes are sent first
+enum SendPriority { PRIORITY_LOW, PRIORITY_NORMAL, PRIORITY_HIGH };
+const unsigned int priorityCount = PRIORITY_HIGH + 1;
+
+struct CodeQueueItem {
+  RCSwitch::CodeValue code;
+  unsigned int length;
+  int protocol;
+  int repeatTransmit;
+  uint8_t priority;
+  /**
+   * Bits of code that carry the state rather than the address, e.g. on/off.
+   * Codes that only differ in these bits are for the same target.
+   */
+  RCSwitch::CodeValue stateMask;
+  /** millis() when the item was queued */
+  unsigned long queuedAt;
+};
+
+const unsigned int maxQueueCount = 30;
+
+// Type A codes carry on/off in the last two tri-state bits
+const unsigned long typeAStateMask = 0xF;
+
+// Buckets of the target index of a queue, a power of two above maxQueueCount
+const unsigned int queueIndexBits = 6;
+const unsigned int queueIndexSize = 1 << queueIndexBits;
+
+/**
+ * Statically allocated FIFO of codes waiting to be sent. Push and pop are
+ * O(1) and never touch the heap.
+ *
+ * A hash index from target to queue slot lets a newer command for a target
+ * replace the queued one in place, e.g. "off" right after "on" only sends
+ * "off", at the position of the "on".
+ */
+class CodeQueue {
+
+  public:
+    CodeQueue();
+
+    // Appends an item or replaces the queued one for the same target, false if the queue is full
+    bool push(const CodeQueueItem &item);
+    // Puts an item back in front of all others, unless a newer one for the
+    // same target is queued. false if the queue is full
+    bool pushFront(const CodeQueueItem &item);
+    // Removes the oldest item, false if the queue is empty
+    bool pop(CodeQueueItem &item);
+
+    unsigned int count() const { return this->nCount; }
+    bool isEmpty() const { return this->nCount == 0; }
+
+    // Highest number of queued items since startup
+    unsigned int getHighWaterMark() const { return this->nHighWaterMark; }
+    // Number of items rejected because the queue was full
+    unsigned long getOverflows() const { return this->nOverflows; }
+    // Number of items that replaced a queued one for the same target
+    unsigned long getCoalesced() const { return this->nCoalesced; }
+
+  private:
+    unsigned int findIndex(const CodeQueueItem &item) const;
+    void removeIndex(unsigned int i);
+    bool coalesce(const CodeQueueItem &item, unsigned int position);
+
+    CodeQueueItem items[maxQueueCount];
+    /* queue slot per bucket, -1 if empty, linear probing */
+    int8_t index[queueIndexSize];
+    unsigned int nHead;
+    unsigned int nCount;
+    unsigned int nHighWaterMark;
+    unsigned long nOverflows;
+    unsigned long nCoalesced;
+};
+
+/**
+ * One send queue per priority class. The highest non-empty class is always
+ * served first, within a class codes are sent in order.
+ */
+class SendScheduler {
+
+  public:
+    SendScheduler();
+
+    bool push(const CodeQueueItem &item);
+    bool pushFront(const CodeQueueItem &item);
+    // Removes the oldest item of the highest non-empty class and records its wait time
+    bool pop(CodeQueueItem &item);
+
+    // Highest class with queued items, -1 if all queues are empty
+    int highestPriority() const;
+
+    // Total number of queued items
+    unsigned int count() const;
+    unsigned int count(unsigned int priority) const { return this->queues[priority].count(); }
+
+    unsigned int getHighWaterMark() const { return this->nHighWaterMark; }
+    unsigned long getOverflows() const;
+    unsigned long getCoalesced() const;
+    // Time items of a class waited in the queue, in milliseconds
+    unsigned long getAverageWait(unsigned int priority) const;
+    unsigned long getMaxWait(unsigned int priority) const { return this->nMaxWait[priority]; }
+
+  private:
+    CodeQueue queues[priorityCount];
+    unsigned int nHighWaterMark;
+    unsigned long nSent[priorityCount];
+    unsigned long nTotalWait[priorityCount];
+    unsigned long nMaxWait[priorityCount];
+};
+
+extern SendScheduler scheduler;
+
+// Adds a code to the send queue of its class, replacing a queued code for
+// the same target (see CodeQueueItem::stateMask). false if that queue is full
+bool queueCode(RCSwitch::CodeValue code, unsigned int length, int protocol, int repeatTransmit, int priority = PRIORITY_NORMAL, RCSwitch::CodeValue stateMask = 0);
+
+// Fills in a queue item, an invalid priority is replaced by PRIORITY_NORMAL
+void initQueueItem(CodeQueueItem &item, RCSwitch::CodeValue code, unsigned int length, int protocol, int repeatTransmit, int priority = PRIORITY_NORMAL, RCSwitch::CodeValue stateMask = 0);
+
+// Whether a send command can be sent as it is: a code length of 1 to
+// RCSWITCH_MAX_CODE_BITS and a protocol of the table
+bool isValidSendCommand(unsigned int codeLength, int protocol);
+
+// Adds all items or, if they might not fit, none of them
+bool queueCodes(const CodeQueueItem* items, unsigned int count);
+
+/*
+ * Binary send command, little endian, one or more packed records of:
+ *   uint32 code, uint8 codeLength, uint8 protocol, uint8 repeatTransmit, uint8 priority
+ */
+const unsigned int binaryCommandSize = 8;
+
+// Decodes packed binary send commands into items, 0 if the payload is invalid
+unsigned int readBinaryCommands(const uint8_t* payload, unsigned int length, CodeQueueItem* items, unsigned int maxCount);
+
+// Starts sending the next queued code once the transmitter is idle, true if one was started.
+// A running transmission is stopped at the end of its current repeat when a
+// code of a higher class is waiting, the remaining repeats are queued again.
+// If its queue has no room left for them, the code is finished first.
+bool sendQueuedCode(RCSwitch &rcSwitch);
+
+// Class of the code on air if it may still be preempted and take a slot of
+// its queue again, -1 otherwise
+int preemptablePriority(RCSwitch &rcSwitch);
+
+const unsigned int maxPendingEvents = 64;
+
+/**
+ * Received codes waiting to be published, oldest first. Keeps events while
+ * MQTT is down. When full the oldest code is dropped, so the latest events
+ * survive a long outage.
+ */
+class EventBuffer {
+
+  public:
+    EventBuffer();
+
+    // Appends a code, dropping the oldest one if the buffer is full
+    void push(const RCSwitch::ReceivedCode &code);
+    // Oldest code without removing it, false if the buffer is empty
+    bool peek(RCSwitch::ReceivedCode &code) const;
+    // Removes the oldest code
+    void pop();
+
+    unsigned int count() const { return this->nCount; }
+    bool isEmpty() const { return this->nCount == 0; }
+    bool isFull() const { return this->nCount == maxPendingEvents; }
+
+    unsigned int getHighWaterMark() const { return this->nHighWaterMark; }
+    // Number of codes dropped because the buffer was full
+    unsigned long getDropped() const { return this->nDropped; }
+
+  private:
+    RCSwitch::ReceivedCode codes[maxPendingEvents];
+    unsigned int nHead;
+    unsigned int nCount;
+    unsigned int nHighWaterMark;
+    unsigned long nDropped;
+};
+
+// Different codes whose presses can overlap, e.g. several remotes at once
+const unsigned int maxActivePresses = 8;
+
+/**
+ * Turns the repeated frames of a button press into one event. Frames with
+ * the same value, protocol and bit length belong to the same press as long
+ * as each follows the previous one within the hold-off time.
+ */
+class ReceiveDeduplicator {
+
+  public:
+    struct Press {
+      // First frame of the press
+      RCSwitch::ReceivedCode code;
+      // Frames after the first one
+      unsigned int repeats;
+      // Milliseconds from the first to the last frame
+      unsigned long duration;
+    };
+    typedef void (*PressHandler)(const Press &press);
+
+    ReceiveDeduplicator();
+
+    // Hold-off in milliseconds, 0 passes every frame on
+    void setHoldOff(unsigned long holdOff) { this->nHoldOff = holdOff; }
+    unsigned long getHoldOff() const { return this->nHoldOff; }
+    // Called with every press that is over, NULL if nobody needs them
+    void setPressHandler(PressHandler handler) { this->pressHandler = handler; }
+
+    // true if the frame starts a new press, false for a repeat
+    bool receive(const RCSwitch::ReceivedCode &code);
+    // Ends the presses without a repeat for longer than the hold-off
+    void handleEndedPresses(unsigned long now);
+
+    // Frames passed to receive() and those that were repeats
+    unsigned long getFrames() const { return this->nFrames; }
+    unsigned long getSuppressed() const { return this->nSuppressed; }
+
+  private:
+    void endPress(unsigned int i);
+
+    Press presses[maxActivePresses];
+    // Timestamp of the latest frame per press
+    unsigned long lastFrame[maxActivePresses];
+    unsigned int nActive;
+    unsigned long nHoldOff;
+    PressHandler pressHandler;
+    unsigned long nFrames;
+    unsigned long nSuppressed;
+};
+
+// Runs the decoder and hands every received code to publish
+void dispatchReceivedCodes(RCSwitch &rcSwitch, void (*publish)(const RCSwitch::ReceivedCode &code));
+
+#endif
@@ -0,0 +1,338 @@
+#include "ProtocolLearner.h"
+
+// Most base pulses in the shortest cluster, e.g. 4 for a protocol with {4, 11} and {9, 6} bits
+static const unsigned int maxShortestPulses = 4;
+
+static const uint8_t noCluster = 0xFF;
+
+/* helper function for the histogram, eighth octave of a duration */
+static inline unsigned int durationBucket(uint32_t duration) {
+  if (duration < 32) {
+    return 0;
+  }
+  const unsigned int octave = 31 - __builtin_clz(duration);
+  const unsigned int bucket = octave * 8 + ((duration >> (octave - 3)) & 7) - 40;
+  return (bucket < PROTOCOLLEARNER_BUCKETS) ? bucket : PROTOCOLLEARNER_BUCKETS - 1;
+}
+
+/* helper function for the histogram, timings[0] is low and the levels alternate */
+static inline unsigned int timingLevel(unsigned int i) {
+  return i & 1;
+}
+
+/* helper function for the skew, a duration of a level as sent */
+static inline long unskewed(unsigned int duration, unsigned int level, int skew) {
+  return level ? (long) duration - skew : (long) duration + skew;
+}
+
+static inline bool sameHighLow(const RCSwitch::HighLow &a, const RCSwitch::HighLow &b) {
+  return a.high == b.high && a.low == b.low;
+}
+
+ProtocolLearner::ProtocolLearner() {
+  this->begin();
+}
+
+void ProtocolLearner::begin() {
+  this->nNext = 0;
+  this->nFrames = 0;
+  memset(&this->result, 0, sizeof(this->result));
+}
+
+bool ProtocolLearner::add(const RCSwitch::CapturedFrame &frame) {
+  // Too short for a single bit, or not a gap followed by pulse pairs and a last high half
+  if (frame.count <= 7 || frame.count % 2 != 0) {
+    return false;
+  }
+
+  RCSwitch::CapturedFrame &stored = this->capturedFrames[this->nNext];
+  memcpy(stored.timings, frame.timings, frame.count * sizeof(frame.timings[0]));
+  stored.count = frame.count;
+  stored.timestamp = frame.timestamp;
+  this->nNext = (this->nNext + 1) % PROTOCOLLEARNER_MAX_FRAMES;
+  if (this->nFrames < PROTOCOLLEARNER_MAX_FRAMES) {
+    this->nFrames++;
+  }
+
+  return this->learn(stored);
+}
+
+/*
+ * Derives the protocol from the kept frames that are equal to the newest
+ * one, so frames of other transmissions and frames with glitches are left
+ * out.
+ */
+bool ProtocolLearner::learn(const RCSwitch::CapturedFrame &reference) {
+  memset(this->bucketCounts, 0, sizeof(this->bucketCounts));
+  memset(this->bucketSums, 0, sizeof(this->bucketSums));
+
+  // The gaps in timings[0] are left out, they contain the repeat delay
+  unsigned int sameLength = 0;
+  for (unsigned int f = 0; f < this->nFrames; f++) {
+    const RCSwitch::CapturedFrame &frame = this->capturedFrames[f];
+    if (frame.count != reference.count) {
+      continue;
+    }
+    sameLength++;
+    for (unsigned int i = 1; i < frame.count; i++) {
+      const unsigned int bucket = durationBucket(frame.timings[i]);
+      this->bucketCounts[timingLevel(i)][bucket]++;
+      this->bucketSums[timingLevel(i)][bucket] += frame.timings[i];
+    }
+  }
+
+  if (sameLength < PROTOCOLLEARNER_MIN_FRAMES || !this->findClusters(sameLength)) {
+    return false;
+  }
+
+  // Either no skew, or the shortest high and low cluster are the same length as sent
+  unsigned int shortest[2] = { ~0u, ~0u };
+  for (unsigned int c = 0; c < this->nClusters; c++) {
+    if (this->clusterLengths[c] < shortest[this->clusterLevels[c]]) {
+      shortest[this->clusterLevels[c]] = this->clusterLengths[c];
+    }
+  }
+  const int skew = (shortest[0] != ~0u && shortest[1] != ~0u) ? ((int) shortest[1] - (int) shortest[0]) / 2 : 0;
+
+  // The fit with the longer base pulse relative to the shortest cluster
+  // wins, a finer one fits any frame but gives narrow windows
+  unsigned long error = 0;
+  unsigned long skewError = 0;
+  unsigned int divisor = 0;
+  unsigned int skewDivisor = 0;
+  const bool fits = this->fitPulseLength(0, error, divisor);
+  const bool skewFits = skew != 0 && this->fitPulseLength(skew, skewError, skewDivisor);
+  if (!fits && !skewFits) {
+    return false;
+  }
+  const bool skewBetter = skewDivisor < divisor || (skewDivisor == divisor && skewError < error);
+  this->result.skew = (skewFits && (!fits || skewBetter)) ? skew : 0;
+  // the cluster lengths of the better fit
+  this->fitPulseLength(this->result.skew, error, divisor);
+
+  // Measures the pulse length on all pulses of the equal frames
+  unsigned int equalFrames = 0;
+  long durationSum = 0;
+  unsigned long pulseSum = 0;
+  long gapSum = 0;
+  for (unsigned int f = 0; f < this->nFrames; f++) {
+    const RCSwitch::CapturedFrame &frame = this->capturedFrames[f];
+    if (!this->agrees(frame, reference)) {
+      continue;
+    }
+    equalFrames++;
+    gapSum += unskewed(frame.timings[0], 0, this->result.skew);
+    for (unsigned int i = 1; i < frame.count; i++) {
+      durationSum += unskewed(frame.timings[i], timingLevel(i), this->result.skew);
+      pulseSum += this->pulses(frame, i);
+    }
+  }
+  if (equalFrames < PROTOCOLLEARNER_MIN_FRAMES || durationSum <= 0 || gapSum <= 0) {
+    return false;
+  }
+
+  RCSwitch::Protocol &protocol = this->result.protocol;
+  const unsigned int pulseLength = (durationSum + pulseSum / 2) / pulseSum;
+  const unsigned int gap = gapSum / equalFrames;
+  const unsigned int gapPulses = (gap + pulseLength / 2) / pulseLength;
+  const unsigned int last = reference.count - 1;
+
+  if (this->findBits(reference, 1, last)) {
+    protocol.syncFactor.high = this->pulses(reference, last);
+    protocol.syncFactor.low = gapPulses;
+    protocol.invertedSignal = false;
+    protocol.sendEndBit = false;
+    protocol.repeatTransmitDelay = 0;
+    protocol.firstSyncTiming = 0;
+    protocol.firstDataTiming = 1;
+  } else if (this->findBits(reference, 3, last)) {
+    // The low half of the end bit and the repeat delay in milliseconds make up the gap
+    const unsigned int endBitLow = pulseLength * protocol.one.low;
+    protocol.syncFactor.high = this->pulses(reference, 1);
+    protocol.syncFactor.low = this->pulses(reference, 2);
+    protocol.invertedSignal = false;
+    protocol.sendEndBit = true;
+    protocol.repeatTransmitDelay = (gap > endBitLow) ? (gap - endBitLow + 500) / 1000 : 0;
+    protocol.firstSyncTiming = 1;
+    protocol.firstDataTiming = 3;
+  } else if (this->findBits(reference, 2, reference.count)) {
+    protocol.syncFactor.high = gapPulses;
+    protocol.syncFactor.low = this->pulses(reference, 1);
+    protocol.invertedSignal = true;
+    protocol.sendEndBit = false;
+    protocol.repeatTransmitDelay = 0;
+    protocol.firstSyncTiming = 0;
+    protocol.firstDataTiming = 2;
+  } else {
+    return false;
+  }
+
+  if (protocol.firstSyncTiming == 0 && gapPulses > 255) {
+    return false;
+  }
+  protocol.pulseLength = pulseLength;
+  this->result.frames = equalFrames;
+  return RCSwitch::isValidProtocol(protocol);
+}
+
+/*
+ * Turns the runs of filled buckets of both levels into clusters. Runs that
+ * do not show up in at least every other frame are glitches.
+ */
+bool ProtocolLearner::findClusters(unsigned int frames) {
+  memset(this->bucketClusters, noCluster, sizeof(this->bucketClusters));
+  this->nClusters = 0;
+
+  for (unsigned int level = 0; level < 2; level++) {
+    unsigned int start = 0;
+    unsigned long count = 0;
+    unsigned long sum = 0;
+    for (unsigned int bucket = 0; bucket <= PROTOCOLLEARNER_BUCKETS; bucket++) {
+      if (bucket < PROTOCOLLEARNER_BUCKETS && this->bucketCounts[level][bucket] > 0) {
+        if (count == 0) {
+          start = bucket;
+        }
+        count += this->bucketCounts[level][bucket];
+        sum += this->bucketSums[level][bucket];
+        continue;
+      }
+
+      if (count * 2 >= frames) {
+        if (this->nClusters == PROTOCOLLEARNER_MAX_CLUSTERS) {
+          return false;
+        }
+        for (unsigned int b = start; b < bucket; b++) {
+          this->bucketClusters[level][b] = this->nClusters;
+        }
+        this->clusterLengths[this->nClusters] = sum / count;
+        this->clusterCounts[this->nClusters] = count;
+        this->clusterLevels[this->nClusters] = level;
+        this->nClusters++;
+      }
+      count = 0;
+      sum = 0;
+    }
+  }
+
+  return this->nClusters >= 2;
+}
+
+/*
+ * Finds the longest base pulse all clusters, corrected by the skew, are
+ * multiples of: the shortest cluster divided by 1 to maxShortestPulses.
+ * Long pulses, e.g. the sync, may be off by a twentieth, short ones by a third
+ * of a base pulse. error is the average deviation in hundredths of a base
+ * pulse per base pulse, divisor the number of base pulses in the shortest
+ * cluster.
+ */
+bool ProtocolLearner::fitPulseLength(int skew, unsigned long &error, unsigned int &divisor) {
+  long shortest = 0;
+  for (unsigned int c = 0; c < this->nClusters; c++) {
+    const long length = unskewed(this->clusterLengths[c], this->clusterLevels[c], skew);
+    if (c == 0 || length < shortest) {
+      shortest = length;
+    }
+  }
+  if (shortest <= 0) {
+    return false;
+  }
+
+  for (divisor = 1; divisor <= maxShortestPulses; divisor++) {
+    bool fits = true;
+    unsigned long deviationSum = 0;
+    unsigned long pulseSum = 0;
+    for (unsigned int c = 0; c < this->nClusters && fits; c++) {
+      // in hundredths of a base pulse
+      const unsigned long scaled = unskewed(this->clusterLengths[c], this->clusterLevels[c], skew) * divisor * 100 / shortest;
+      const unsigned long pulses = (scaled + 50) / 100;
+      const unsigned long deviation = (scaled > pulses * 100) ? scaled - pulses * 100 : pulses * 100 - scaled;
+      const unsigned long maxDeviation = (pulses * 5 > 35) ? pulses * 5 : 35;
+      fits = pulses > 0 && pulses <= 255 && deviation <= maxDeviation;
+      this->clusterPulses[c] = pulses;
+      deviationSum += deviation * this->clusterCounts[c];
+      pulseSum += pulses * this->clusterCounts[c];
+    }
+    if (fits) {
+      error = deviationSum / pulseSum;
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * true if every pulse half of frame is in the same cluster as in reference
+ * and the gaps, which have no clusters, differ by at most an eighth
+ */
+bool ProtocolLearner::agrees(const RCSwitch::CapturedFrame &frame, const RCSwitch::CapturedFrame &reference) const {
+  if (frame.count != reference.count) {
+    return false;
+  }
+  const unsigned int gap = reference.timings[0];
+  if (frame.timings[0] + gap / 8 < gap || frame.timings[0] > gap + gap / 8) {
+    return false;
+  }
+  for (unsigned int i = 1; i < frame.count; i++) {
+    const uint8_t c = this->cluster(frame, i);
+    if (c == noCluster || c != this->cluster(reference, i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* cluster of timings[i] of a frame, noCluster for a glitch */
+uint8_t ProtocolLearner::cluster(const RCSwitch::CapturedFrame &frame, unsigned int i) const {
+  return this->bucketClusters[timingLevel(i)][durationBucket(frame.timings[i])];
+}
+
+/* length of timings[i] of a frame in base pulses */
+unsigned int ProtocolLearner::pulses(const RCSwitch::CapturedFrame &frame, unsigned int i) const {
+  return this->clusterPulses[this->cluster(frame, i)];
+}
+
+/*
+ * Reads the data bits from firstDataTiming up to endTiming, false unless
+ * they are made of exactly two pulse pairs and there are at most
+ * RCSWITCH_MAX_CODE_BITS of them.
+ */
+bool ProtocolLearner::findBits(const RCSwitch::CapturedFrame &reference, unsigned int firstDataTiming, unsigned int endTiming) {
+  RCSwitch::HighLow bits[2];
+  unsigned int bitCount = 0;
+
+  // The code would lose its first bits and could not be sent
+  if (endTiming < firstDataTiming || (endTiming - firstDataTiming) / 2 > RCSWITCH_MAX_CODE_BITS) {
+    return false;
+  }
+
+  for (unsigned int i = firstDataTiming; i + 1 < endTiming; i += 2) {
+    const RCSwitch::HighLow bit = { (uint8_t) this->pulses(reference, i), (uint8_t) this->pulses(reference, i + 1) };
+    if (bitCount > 0 && sameHighLow(bit, bits[0])) {
+      continue;
+    }
+    if (bitCount > 1 && sameHighLow(bit, bits[1])) {
+      continue;
+    }
+    if (bitCount == 2) {
+      return false;
+    }
+    bits[bitCount++] = bit;
+  }
+  if (bitCount != 2) {
+    return false;
+  }
+
+  const bool swap = bits[1].high < bits[0].high || (bits[1].high == bits[0].high && bits[1].low > bits[0].low);
+  RCSwitch::Protocol &protocol = this->result.protocol;
+  protocol.zero = bits[swap ? 1 : 0];
+  protocol.one = bits[swap ? 0 : 1];
+
+  this->result.code = 0;
+  this->result.bitLength = 0;
+  for (unsigned int i = firstDataTiming; i + 1 < endTiming; i += 2) {
+    const bool one = sameHighLow({ (uint8_t) this->pulses(reference, i), (uint8_t) this->pulses(reference, i + 1) }, protocol.one);
+    this->result.code = (this->result.code << 1) | (one ? 1 : 0);
+    this->result.bitLength++;
+  }
+  return true;
+}
@@ -0,0 +1,114 @@
+/*
+  Derives a protocol definition from transmissions no protocol could decode.
+
+  The learner is fed the repeats of an unknown transmission from the
+  capture queue (see RCSwitch::readCaptured()) and sorts their high and
+  their low pulse halves into logarithmic histograms with 8 buckets per
+  octave. Runs of filled buckets are the clusters of the distinct pulse
+  lengths. Receivers stretch one level and shorten the other, so the
+  clusters are also tried corrected by half the difference of the shortest
+  high and low one. The base pulse length is the largest one all clusters,
+  with or without the correction, are close multiples of. Frames are only
+  learned from together if their gaps differ by at most an eighth. Counted
+  in base pulses, a frame is read as one of:
+
+    timings[0]             gap, the low half of the sync
+    timings[1 .. n - 2]    data bits, a high and a low half each
+    timings[n - 1]         high half of the sync before the next gap
+
+  or, for remotes that send the sync right before the data:
+
+    timings[0]             gap, the low half of the end bit and the repeat delay
+    timings[1], [2]        sync
+    timings[3 .. n - 2]    data bits
+    timings[n - 1]         high half of the end bit
+
+  or, for remotes with an inverted signal:
+
+    timings[0]             gap, the low half of the sync
+    timings[1]             high half of the sync
+    timings[2 .. n - 1]    data bits, a low and a high half each
+
+  The data bits have to be made of exactly two pulse pairs, the one with
+  the shorter first half (or else the longer second half) is taken for the
+  zero bit. A code needs both bits to be learned.
+
+  The result can be loaded with RCSwitch::loadProtocols(), e.g. published
+  by the gateway in the format of its receiver/protocols property.
+*/
+#ifndef _ProtocolLearner_h
+#define _ProtocolLearner_h
+
+#include "Arduino.h"
+#include "RCSwitch.h"
+
+// Equal frames needed before a protocol is derived
+#ifndef PROTOCOLLEARNER_MIN_FRAMES
+#define PROTOCOLLEARNER_MIN_FRAMES 3
+#endif
+
+// Most recent frames kept, older ones are replaced
+#ifndef PROTOCOLLEARNER_MAX_FRAMES
+#define PROTOCOLLEARNER_MAX_FRAMES 8
+#endif
+
+// Distinct pulse lengths of a frame, sync and data, of both levels
+#define PROTOCOLLEARNER_MAX_CLUSTERS 8
+
+// Histogram buckets, 8 per octave from 32 us to 64 ms
+#define PROTOCOLLEARNER_BUCKETS 88
+
+class ProtocolLearner {
+
+  public:
+    struct Result {
+      RCSwitch::Protocol protocol;
+      /** the code of the frames learned from, with this protocol */
+      RCSwitch::CodeValue code;
+      unsigned int bitLength;
+      /** number of equal frames learned from */
+      unsigned int frames;
+      /** microseconds the received high halves are longer than nominal, the low halves are shorter by as much */
+      int skew;
+    };
+
+    ProtocolLearner();
+
+    // Forgets all frames
+    void begin();
+    // Adds a frame, true once a protocol could be derived, see getResult()
+    bool add(const RCSwitch::CapturedFrame &frame);
+
+    const Result& getResult() const { return this->result; }
+    // Number of frames kept
+    unsigned int frames() const { return this->nFrames; }
+
+  private:
+    bool learn(const RCSwitch::CapturedFrame &reference);
+    bool findClusters(unsigned int frames);
+    bool fitPulseLength(int skew, unsigned long &error, unsigned int &divisor);
+    bool agrees(const RCSwitch::CapturedFrame &frame, const RCSwitch::CapturedFrame &reference) const;
+    uint8_t cluster(const RCSwitch::CapturedFrame &frame, unsigned int i) const;
+    unsigned int pulses(const RCSwitch::CapturedFrame &frame, unsigned int i) const;
+    bool findBits(const RCSwitch::CapturedFrame &reference, unsigned int firstDataTiming, unsigned int endTiming);
+
+    RCSwitch::CapturedFrame capturedFrames[PROTOCOLLEARNER_MAX_FRAMES];
+    unsigned int nNext;
+    unsigned int nFrames;
+
+    /* count and sum of the durations per bucket, low and high level */
+    uint16_t bucketCounts[2][PROTOCOLLEARNER_BUCKETS];
+    uint32_t bucketSums[2][PROTOCOLLEARNER_BUCKETS];
+    /* cluster of every bucket, 0xFF for none */
+    uint8_t bucketClusters[2][PROTOCOLLEARNER_BUCKETS];
+    /* average duration, number of durations, level and length in base pulses of every cluster */
+    unsigned int clusterLengths[PROTOCOLLEARNER_MAX_CLUSTERS];
+    unsigned int clusterCounts[PROTOCOLLEARNER_MAX_CLUSTERS];
+    uint8_t clusterLevels[PROTOCOLLEARNER_MAX_CLUSTERS];
+    unsigned int clusterPulses[PROTOCOLLEARNER_MAX_CLUSTERS];
+    unsigned int nClusters;
+
+    Result result;
+};
+
+#endif
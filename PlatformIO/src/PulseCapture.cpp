@@ -0,0 +1,100 @@
+#include "PulseCapture.h"
+
+static const uint8_t magic[4] = { 'R', 'C', 'P', 'C' };
+
+static inline uint8_t* writeVarint(uint8_t* out, uint32_t value) {
+  while (value >= 0x80) {
+    *out++ = (uint8_t) (value | 0x80);
+    value >>= 7;
+  }
+  *out++ = (uint8_t) value;
+  return out;
+}
+
+static inline uint32_t zigzag(int32_t value) {
+  return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t value) {
+  return (int32_t) (value >> 1) ^ -(int32_t) (value & 1);
+}
+
+size_t writePulseCaptureHeader(uint8_t* out) {
+  memcpy(out, magic, sizeof(magic));
+  out[sizeof(magic)] = PULSECAPTURE_VERSION;
+  return PULSECAPTURE_HEADER_SIZE;
+}
+
+PulseCaptureBuffer::PulseCaptureBuffer() {
+  this->begin(false);
+}
+
+void PulseCaptureBuffer::begin(bool bHeader) {
+  this->nSize = bHeader ? writePulseCaptureHeader(this->buffer) : 0;
+  this->nFrames = 0;
+}
+
+bool PulseCaptureBuffer::append(const RCSwitch::CapturedFrame &frame) {
+  // Checking the worst case keeps the encoder free of bounds checks
+  if (PULSECAPTURE_BUFFER_SIZE - this->nSize < PULSECAPTURE_MAX_RECORD_SIZE) {
+    return false;
+  }
+
+  uint8_t* out = this->buffer + this->nSize;
+  out = writeVarint(out, frame.timestamp);
+  out = writeVarint(out, frame.count);
+
+  for (unsigned int i = 0; i < frame.count; i++) {
+    const int32_t previous = (i >= 2) ? (int32_t) frame.timings[i - 2] : 0;
+    out = writeVarint(out, zigzag((int32_t) frame.timings[i] - previous));
+  }
+
+  this->nSize = out - this->buffer;
+  this->nFrames++;
+  return true;
+}
+
+PulseCaptureReader::PulseCaptureReader(const uint8_t* data, size_t size) {
+  this->pData = data;
+  this->pEnd = data + size;
+  this->bValid = size >= PULSECAPTURE_HEADER_SIZE
+    && memcmp(data, magic, sizeof(magic)) == 0
+    && data[sizeof(magic)] == PULSECAPTURE_VERSION;
+
+  if (this->bValid) {
+    this->pData += PULSECAPTURE_HEADER_SIZE;
+  }
+}
+
+bool PulseCaptureReader::readVarint(uint32_t &value) {
+  value = 0;
+  for (unsigned int shift = 0; shift < 35 && this->pData < this->pEnd; shift += 7) {
+    const uint8_t byte = *this->pData++;
+    value |= (uint32_t) (byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool PulseCaptureReader::next(RCSwitch::CapturedFrame &frame) {
+  uint32_t timestamp;
+  uint32_t count;
+  if (!this->bValid || !this->readVarint(timestamp) || !this->readVarint(count) || count > RCSWITCH_MAX_CHANGES) {
+    return false;
+  }
+
+  for (unsigned int i = 0; i < count; i++) {
+    uint32_t delta;
+    if (!this->readVarint(delta)) {
+      return false;
+    }
+    const int32_t previous = (i >= 2) ? (int32_t) frame.timings[i - 2] : 0;
+    frame.timings[i] = (unsigned int) (previous + unzigzag(delta));
+  }
+
+  frame.timestamp = timestamp;
+  frame.count = count;
+  return true;
+}
@@ -0,0 +1,87 @@
+/*
+  Compact binary format for raw pulse captures.
+
+  A capture stream starts with a header, the magic "RCPC" followed by the
+  format version, and continues with self contained records, one per
+  captured frame:
+
+    varint   timestamp   millis() at capture time
+    varint   count       number of durations
+    count x  zigzag varint of timings[i] - timings[i - 2]
+
+  Durations are stored as the difference to the previous duration of the
+  same level (timings[-1] and timings[-2] count as 0), which keeps the
+  repeating short/long pulses of a frame at one byte each. Varints use 7
+  bits per byte, least significant group first, with the high bit set on
+  all but the last byte.
+
+  The same stream is written to SPIFFS, published over MQTT and read back
+  on the host, where it can be memory mapped and replayed (env:bench).
+*/
+#ifndef _PulseCapture_h
+#define _PulseCapture_h
+
+#include "Arduino.h"
+#include "RCSwitch.h"
+
+#define PULSECAPTURE_VERSION 1
+#define PULSECAPTURE_HEADER_SIZE 5
+
+// Worst case size of one record: 5 bytes per varint
+#define PULSECAPTURE_MAX_RECORD_SIZE ((2 + RCSWITCH_MAX_CHANGES) * 5)
+
+// Size of the RAM buffer frames are batched in before they are written out
+#ifndef PULSECAPTURE_BUFFER_SIZE
+#define PULSECAPTURE_BUFFER_SIZE 1024
+#endif
+
+// Writes the stream header to out, which must hold PULSECAPTURE_HEADER_SIZE bytes
+size_t writePulseCaptureHeader(uint8_t* out);
+
+/**
+ * Batches encoded frames in RAM so they can be written to flash or
+ * published in one go, outside of the receive interrupt.
+ */
+class PulseCaptureBuffer {
+
+  public:
+    PulseCaptureBuffer();
+
+    // Starts a new stream, with header if bHeader is set
+    void begin(bool bHeader);
+    // Encodes a frame, false if it does not fit into the remaining space
+    bool append(const RCSwitch::CapturedFrame &frame);
+
+    const uint8_t* data() const { return this->buffer; }
+    size_t size() const { return this->nSize; }
+    // Number of frames appended since begin()
+    unsigned int frames() const { return this->nFrames; }
+
+  private:
+    uint8_t buffer[PULSECAPTURE_BUFFER_SIZE];
+    size_t nSize;
+    unsigned int nFrames;
+};
+
+/**
+ * Iterates over the records of a capture stream held in memory.
+ */
+class PulseCaptureReader {
+
+  public:
+    PulseCaptureReader(const uint8_t* data, size_t size);
+
+    // false if the stream does not start with a known header
+    bool isValid() const { return this->bValid; }
+    // Decodes the next record, false at the end of the stream or on a truncated record
+    bool next(RCSwitch::CapturedFrame &frame);
+
+  private:
+    bool readVarint(uint32_t &value);
+
+    const uint8_t* pData;
+    const uint8_t* pEnd;
+    bool bValid;
+};
+
+#endif
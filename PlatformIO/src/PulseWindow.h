@@ -0,0 +1,35 @@
+/*
+  Integer acceptance window for one pulse duration, as used by the decoder
+  of RCSwitch.
+
+  A duration t matches if (t - lower) < width, computed unsigned, which is
+  equivalent to diff(t, target) < tolerance without any abs() or division
+  per bit. The windows are built once per frame from the pulse length
+  measured on the sync pulse.
+*/
+#ifndef _PulseWindow_h
+#define _PulseWindow_h
+
+struct PulseWindow {
+    unsigned int lower;
+    unsigned int width;
+
+    void set(unsigned int target, unsigned int tolerance) {
+        if (tolerance == 0) {
+            lower = 0;
+            width = 0;
+        } else if (target >= tolerance) {
+            lower = target - tolerance + 1;
+            width = 2 * tolerance - 1;
+        } else {
+            lower = 0;
+            width = target + tolerance;
+        }
+    }
+
+    bool matches(unsigned int duration) const {
+        return (unsigned int)(duration - lower) < width;
+    }
+};
+
+#endif
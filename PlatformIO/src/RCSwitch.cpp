@@ -32,6 +32,7 @@
 */
 
 #include "RCSwitch.h"
+#include "PulseWindow.h"
 
 #ifdef RaspberryPi
     // PROGMEM and _P functions are for AVR based microprocessors,
@@ -50,6 +51,22 @@
     #define RECEIVE_ATTR
 #endif
 
+#if (RCSWITCH_EDGE_BUFFER_SIZE & (RCSWITCH_EDGE_BUFFER_SIZE - 1)) != 0
+    #error "RCSWITCH_EDGE_BUFFER_SIZE must be a power of two"
+#endif
+
+#if (RCSWITCH_RECEIVE_QUEUE_SIZE & (RCSWITCH_RECEIVE_QUEUE_SIZE - 1)) != 0
+    #error "RCSWITCH_RECEIVE_QUEUE_SIZE must be a power of two"
+#endif
+
+// Keeps the compiler (and the CPU on multi core targets) from reordering the
+// edge buffer accesses around the index updates.
+#define RCSWITCH_MEMORY_BARRIER() __sync_synchronize()
+
+// The level after an edge is stored in the most significant bit of the
+// buffered duration.
+static const unsigned int EDGE_RISING = ~(~0u >> 1);
+
 
 /* Format for protocol definitions:
  * {pulselength, Sync bit, "0" bit, "1" bit}
@@ -69,6 +86,9 @@
  *     |   |_
  *
  * These are combined to form Tri-State bits when sending or receiving codes.
+ *
+ * These built-in protocols fill the protocol table at startup, see
+ * loadProtocols().
  */
 #if defined(ESP8266) || defined(ESP32)
 static const RCSwitch::Protocol proto[] = {
@@ -90,28 +110,93 @@ enum {
    numProto = sizeof(proto) / sizeof(proto[0])
 };
 
+// The decoder tracks the protocol candidates in a 32 bit mask
+static_assert(RCSWITCH_MAX_PROTOCOLS <= 32, "too many protocols for the decoder candidate mask");
+static_assert(numProto <= RCSWITCH_MAX_PROTOCOLS, "the built-in protocols do not fit into the protocol table");
+
+/*
+ * The protocols used to send and receive. loadProtocols() fills
+ * loadedTable, applyLoadedProtocols() swaps it in where the decoder and
+ * setProtocol() run, so they never see a half written table.
+ */
+static RCSwitch::Protocol protocolTable[RCSWITCH_MAX_PROTOCOLS];
+static unsigned int protocolCount = 0;
+static RCSwitch::Protocol loadedTable[RCSWITCH_MAX_PROTOCOLS];
+static unsigned int loadedCount = 0;
+static volatile bool protocolsLoaded = false;
+
+RCSwitch::TransmitState RCSwitch::transmitState;
+volatile bool RCSwitch::bTransmitting = false;
+#if defined(ESP32)
+static hw_timer_t* pTransmitTimer = NULL;
+#endif
+
 #if not defined( RCSwitchDisableReceiving )
 int RCSwitch::nReceiverInterrupt = -1;
-volatile unsigned long RCSwitch::nReceivedValue = 0;
-volatile unsigned int RCSwitch::nReceivedBitlength = 0;
-volatile unsigned int RCSwitch::nReceivedDelay = 0;
-volatile unsigned int RCSwitch::nReceivedProtocol = 0;
+RCSwitch::ReceivedCode RCSwitch::receivedCodes[RCSWITCH_RECEIVE_QUEUE_SIZE];
+volatile unsigned int RCSwitch::nReceivedHead = 0;
+volatile unsigned int RCSwitch::nReceivedTail = 0;
+volatile unsigned long RCSwitch::nDroppedCodes = 0;
+volatile unsigned long RCSwitch::nDecodeAttempts = 0;
 int RCSwitch::nReceiveTolerance = 60;
 const unsigned int RCSwitch::nSeparationLimit = 4300;
 // separationLimit: minimum microseconds between received codes, closer codes are ignored.
 // according to discussion on issue #14 it might be more suitable to set the separation
 // limit to the same time as the 'low' part of the sync signal for the current protocol.
 unsigned int RCSwitch::timings[RCSWITCH_MAX_CHANGES];
+RCSwitch::CapturedFrame RCSwitch::capturedFrames[RCSWITCH_CAPTURE_QUEUE_SIZE];
+volatile unsigned int RCSwitch::nCapturedHead = 0;
+volatile unsigned int RCSwitch::nCapturedTail = 0;
+volatile unsigned long RCSwitch::nDroppedCaptures = 0;
+bool RCSwitch::bCaptureUnknown = false;
+bool RCSwitch::bCalibrate = true;
+
+/*
+ * Learned pulse timing per protocol (see RCSwitch::Calibration), in
+ * 1/calibrationScale microseconds so the averages keep their fraction.
+ * Only the decoder writes it.
+ */
+struct ProtocolCalibration {
+    long pulseLength;
+    long highOffset;
+    long lowOffset;
+    long jitter;
+    unsigned long frames;
+};
+static const long calibrationScale = 16;
+static ProtocolCalibration calibrations[RCSWITCH_MAX_PROTOCOLS];
+// Set by resetCalibration(), the decoder clears calibrations[] between frames
+static volatile bool calibrationResetRequested = false;
+
+/*
+ * Protocols whose sync pulse fits a duration, per firstSyncTiming and
+ * quarter octave of the duration (see syncBucket()). The decoder only tries
+ * these on a frame.
+ */
+static const unsigned int syncBucketCount = 64;
+static uint32_t syncIndex[2][syncBucketCount];
+unsigned int RCSwitch::edges[RCSWITCH_EDGE_BUFFER_SIZE];
+volatile unsigned int RCSwitch::nEdgeHead = 0;
+volatile unsigned int RCSwitch::nEdgeTail = 0;
+volatile unsigned long RCSwitch::nEdgeOverruns = 0;
+unsigned int RCSwitch::nChangeCount = 0;
+unsigned int RCSwitch::nRepeatCount = 0;
 #endif
 
 RCSwitch::RCSwitch() {
+  if (protocolCount == 0) {
+    RCSwitch::loadProtocols(NULL, 0);
+    RCSwitch::applyLoadedProtocols();
+  }
   this->nTransmitterPin = -1;
+  this->nWaveformCacheEntries = 0;
+  this->nWaveformCacheHits = 0;
+  this->nWaveformCacheMisses = 0;
   this->setRepeatTransmit(10);
   this->setProtocol(1);
   #if not defined( RCSwitchDisableReceiving )
   RCSwitch::nReceiverInterrupt = -1;
   this->setReceiveTolerance(60);
-  RCSwitch::nReceivedValue = 0;
   #endif
 }
 
@@ -126,14 +211,11 @@ void RCSwitch::setProtocol(Protocol protocol) {
   * Sets the protocol to send, from a list of predefined protocols
   */
 void RCSwitch::setProtocol(int nProtocol) {
-  if (nProtocol < 1 || nProtocol > numProto) {
+  RCSwitch::applyLoadedProtocols();
+  if (nProtocol < 1 || nProtocol > (int) protocolCount) {
     nProtocol = 1;  // TODO: trigger an error, e.g. "bad protocol" ???
   }
-#if defined(ESP8266) || defined(ESP32)
-  this->protocol = proto[nProtocol-1];
-#else
-  memcpy_P(&this->protocol, &proto[nProtocol-1], sizeof(Protocol));
-#endif
+  this->protocol = protocolTable[nProtocol-1];
 }
 
 /**
@@ -145,6 +227,157 @@ void RCSwitch::setProtocol(int nProtocol, int nPulseLength) {
 }
 
 
+/**
+  * Number of protocols in the protocol table, valid protocol numbers are 1..count
+  */
+unsigned int RCSwitch::getProtocolCount() {
+  return protocolCount;
+}
+
+/**
+ * Copies a protocol of the protocol table.
+ *
+ * @param nProtocol   protocol number, starting with 1
+ * @return false if there is no such protocol
+ */
+bool RCSwitch::getProtocol(unsigned int nProtocol, Protocol &protocol) {
+  if (nProtocol < 1 || nProtocol > protocolCount) {
+    return false;
+  }
+  protocol = protocolTable[nProtocol - 1];
+  return true;
+}
+
+/**
+ * Copies a built-in protocol, whatever table is loaded.
+ *
+ * @param nProtocol   protocol number in the built-in table, starting with 1
+ * @return false if there is no such protocol
+ */
+bool RCSwitch::getBuiltInProtocol(unsigned int nProtocol, Protocol &protocol) {
+  if (nProtocol < 1 || nProtocol > numProto) {
+    return false;
+  }
+#if defined(ESP8266) || defined(ESP32)
+  protocol = proto[nProtocol - 1];
+#else
+  memcpy_P(&protocol, &proto[nProtocol - 1], sizeof(Protocol));
+#endif
+  return true;
+}
+
+/**
+ * Checks what the decoder relies on: a pulse length, a sync pulse in
+ * timings[0] or timings[1] followed by the data, and zero and one bits
+ * that can be told apart. The repeat delay is limited to
+ * RCSWITCH_MAX_REPEAT_DELAY.
+ */
+bool RCSwitch::isValidProtocol(const Protocol &protocol) {
+  return protocol.pulseLength > 0 &&
+         (protocol.syncFactor.high > 0 || protocol.syncFactor.low > 0) &&
+         protocol.firstSyncTiming <= 1 &&
+         protocol.firstDataTiming > protocol.firstSyncTiming && protocol.firstDataTiming <= 3 &&
+         protocol.zero.high + protocol.zero.low > 0 &&
+         protocol.one.high + protocol.one.low > 0 &&
+         (protocol.zero.high != protocol.one.high || protocol.zero.low != protocol.one.low) &&
+         protocol.repeatTransmitDelay <= RCSWITCH_MAX_REPEAT_DELAY;
+}
+
+/**
+ * Replaces the protocol table, protocol numbers are positions in the table
+ * starting with 1. An empty table restores the built-in protocols.
+ *
+ * The new table is used from the next call of handleReceivedEdges() or
+ * setProtocol(int), so it can be loaded from another task than the one
+ * receiving and sending. The learned calibration is reset then.
+ *
+ * @return false if a protocol is invalid, the table is too large or the
+ *         previously loaded table is not used yet, see isLoadingProtocols()
+ */
+bool RCSwitch::loadProtocols(const Protocol* table, unsigned int count) {
+  if (protocolsLoaded || count > RCSWITCH_MAX_PROTOCOLS) {
+    return false;
+  }
+  for (unsigned int i = 0; i < count; i++) {
+    if (!RCSwitch::isValidProtocol(table[i])) {
+      return false;
+    }
+  }
+
+  if (count == 0) {
+#if defined(ESP8266) || defined(ESP32)
+    memcpy(loadedTable, proto, sizeof(proto));
+#else
+    memcpy_P(loadedTable, proto, sizeof(proto));
+#endif
+    loadedCount = numProto;
+  } else {
+    memcpy(loadedTable, table, count * sizeof(Protocol));
+    loadedCount = count;
+  }
+  RCSWITCH_MEMORY_BARRIER();
+  protocolsLoaded = true;
+  return true;
+}
+
+/**
+ * Whether a table passed to loadProtocols() is waiting to be used.
+ */
+bool RCSwitch::isLoadingProtocols() {
+  return protocolsLoaded;
+}
+
+#if not defined( RCSwitchDisableReceiving )
+/* helper function for the sync index, quarter octave of a duration */
+static inline unsigned int syncBucket(uint32_t duration) {
+  if (duration < 16) {
+    return 0;
+  }
+  const unsigned int octave = 31 - __builtin_clz(duration);
+  const unsigned int bucket = octave * 4 + ((duration >> (octave - 2)) & 3) - 12;
+  return (bucket < syncBucketCount) ? bucket : syncBucketCount - 1;
+}
+
+/*
+ * Fills the sync index from the protocol table. A remote may run at half to
+ * twice the pulse length of its protocol, the decoder measures it on the
+ * sync pulse.
+ */
+static void buildSyncIndex() {
+  memset(syncIndex, 0, sizeof(syncIndex));
+  for (unsigned int p = 0; p < protocolCount; p++) {
+    const RCSwitch::Protocol &pro = protocolTable[p];
+    const uint32_t syncLengthInPulses = (pro.syncFactor.low > pro.syncFactor.high) ? pro.syncFactor.low : pro.syncFactor.high;
+    const uint32_t syncDuration = pro.pulseLength * syncLengthInPulses;
+    const unsigned int last = syncBucket(syncDuration * 2);
+    for (unsigned int bucket = syncBucket(syncDuration / 2); bucket <= last; bucket++) {
+      syncIndex[pro.firstSyncTiming][bucket] |= (uint32_t) 1 << p;
+    }
+  }
+}
+#endif
+
+/*
+ * Starts using a table passed to loadProtocols(), called where the decoder
+ * and setProtocol() run.
+ */
+void RCSwitch::applyLoadedProtocols() {
+  if (!protocolsLoaded) {
+    return;
+  }
+
+  RCSWITCH_MEMORY_BARRIER();
+  memcpy(protocolTable, loadedTable, loadedCount * sizeof(Protocol));
+  protocolCount = loadedCount;
+#if not defined( RCSwitchDisableReceiving )
+  buildSyncIndex();
+  // the learned timing belongs to the old protocol numbers
+  memset(calibrations, 0, sizeof(calibrations));
+#endif
+  RCSWITCH_MEMORY_BARRIER();
+  protocolsLoaded = false;
+}
+
 /**
   * Sets pulse length in microseconds
   */
@@ -441,7 +674,7 @@ char* RCSwitch::getCodeWordD(char sGroup, int nDevice, bool bStatus) {
   return sReturn;
 }
 
-void RCSwitch::triStateGetCodeAndLength(const char* sCodeWord, unsigned long &code, unsigned int &length) {
+void RCSwitch::triStateGetCodeAndLength(const char* sCodeWord, CodeValue &code, unsigned int &length) {
   // turn the tristate code word into the corresponding bit pattern, then send it
   for (const char* p = sCodeWord; *p; p++) {
     code <<= 2L;
@@ -466,7 +699,7 @@ void RCSwitch::triStateGetCodeAndLength(const char* sCodeWord, unsigned long &co
  * @param sCodeWord   a tristate code word consisting of the letter 0, 1, F
  */
 void RCSwitch::sendTriState(const char* sCodeWord) {
-  unsigned long code = 0;
+  CodeValue code = 0;
   unsigned int length = 0;
   triStateGetCodeAndLength(sCodeWord, code, length);
   this->send(code, length);
@@ -477,7 +710,7 @@ void RCSwitch::sendTriState(const char* sCodeWord) {
  */
 void RCSwitch::send(const char* sCodeWord) {
   // turn the tristate code word into the corresponding bit pattern, then send it
-  unsigned long code = 0;
+  CodeValue code = 0;
   unsigned int length = 0;
   for (const char* p = sCodeWord; *p; p++) {
     code <<= 1L;
@@ -493,11 +726,15 @@ void RCSwitch::send(const char* sCodeWord) {
  * bits are sent from MSB to LSB, i.e., first the bit at position length-1,
  * then the bit at position length-2, and so on, till finally the bit at position 0.
  */
-void RCSwitch::send(unsigned long code, unsigned int length) {
+void RCSwitch::send(CodeValue code, unsigned int length) {
   //printer->println(code);
   if (this->nTransmitterPin == -1)
     return;
 
+  // let a transmission started by sendAsync() finish first
+  while (this->isTransmitting()) {
+  }
+
 #if not defined( RCSwitchDisableReceiving )
   // make sure the receiver is disabled while we transmit
   int nReceiverInterrupt_backup = RCSwitch::nReceiverInterrupt;
@@ -506,20 +743,18 @@ void RCSwitch::send(unsigned long code, unsigned int length) {
   }
 #endif
   
+  const Waveform &waveform = this->getWaveform(code, length);
+  const uint8_t firstLogicLevel = (waveform.invertedSignal) ? LOW : HIGH;
+  const uint8_t secondLogicLevel = (waveform.invertedSignal) ? HIGH : LOW;
+
   for (int nRepeat = 0; nRepeat < nRepeatTransmit; nRepeat++) {
-    for (int i = length-1; i >= 0; i--) {
-      if (code & (1L << i))
-        this->transmit(protocol.one);
-      else
-        this->transmit(protocol.zero);
-    }
-    
-    if (this->protocol.sendEndBit) {
-      this->transmit(protocol.one);
+    for (unsigned int i = 0; i < waveform.nEdges; i++) {
+      digitalWrite(this->nTransmitterPin, (i & 1) ? secondLogicLevel : firstLogicLevel);
+      delayMicroseconds(waveform.durations[i]);
+      if (i == waveform.nGapEdge) {
+        delay(waveform.repeatTransmitDelay);
+      }
     }
-
-    delay(protocol.repeatTransmitDelay);
-    this->transmit(protocol.syncFactor);
   }
 
   // Disable transmit after sending (i.e., for inverted protocols)
@@ -534,18 +769,231 @@ void RCSwitch::send(unsigned long code, unsigned int length) {
 }
 
 /**
- * Transmit a single high-low pulse.
+ * Starts transmitting the first 'length' bits of 'code' (see send()) and
+ * returns immediately. The pulses are emitted at absolute deadlines by a
+ * hardware timer on the ESP32; on other targets handleTransmit() or
+ * isTransmitting() has to be called frequently.
+ *
+ * Received edges are ignored while the transmission is running.
+ *
+ * @return false if no transmitter is enabled or a transmission is running
  */
-void RCSwitch::transmit(HighLow pulses) {
-  uint8_t firstLogicLevel = (this->protocol.invertedSignal) ? LOW : HIGH;
-  uint8_t secondLogicLevel = (this->protocol.invertedSignal) ? HIGH : LOW;
-  
-  digitalWrite(this->nTransmitterPin, firstLogicLevel);
-  delayMicroseconds( this->protocol.pulseLength * pulses.high);
-  digitalWrite(this->nTransmitterPin, secondLogicLevel);
-  delayMicroseconds( this->protocol.pulseLength * pulses.low);
+bool RCSwitch::sendAsync(CodeValue code, unsigned int length) {
+  if (this->nTransmitterPin == -1 || RCSwitch::bTransmitting)
+    return false;
+
+  TransmitState &t = RCSwitch::transmitState;
+  // copied, the cache entry may be replaced while the transmission runs
+  t.waveform = this->getWaveform(code, length);
+  t.nTransmitterPin = this->nTransmitterPin;
+  t.nEdge = 0;
+  t.nRepeatsLeft = this->nRepeatTransmit;
+  t.bStopRequested = false;
+  t.nRepeatsSkipped = 0;
+
+  if (t.nRepeatsLeft <= 0)
+    return true;
+
+  RCSwitch::bTransmitting = true;
+
+#if defined(ESP32)
+  if (pTransmitTimer == NULL) {
+    // 80 MHz APB clock / 80 = one tick per microsecond
+    pTransmitTimer = timerBegin(RCSWITCH_TRANSMIT_TIMER, 80, true);
+    timerAttachInterrupt(pTransmitTimer, &RCSwitch::handleTransmitTimer, true);
+  }
+  t.nDeadline = timerRead(pTransmitTimer);
+  handleTransmitTimer();
+#else
+  t.nDeadline = micros();
+  this->handleTransmit();
+#endif
+  return true;
+}
+
+/**
+ * @return true while a transmission started by sendAsync() is running
+ */
+bool RCSwitch::isTransmitting() {
+  this->handleTransmit();
+  return RCSwitch::bTransmitting;
+}
+
+/**
+ * Ends the running asynchronous transmission once the current repeat is
+ * complete, so a receiver never sees a truncated frame. Use
+ * getSkippedRepeats() after isTransmitting() turned false to find out how
+ * many repeats were left out.
+ */
+void RCSwitch::stopTransmitAfterRepeat() {
+  RCSwitch::transmitState.bStopRequested = true;
+}
+
+/**
+ * @return the number of repeats of the last asynchronous transmission that
+ *         were not sent because of stopTransmitAfterRepeat()
+ */
+int RCSwitch::getSkippedRepeats() {
+  return RCSwitch::bTransmitting ? 0 : RCSwitch::transmitState.nRepeatsSkipped;
+}
+
+/**
+ * Emits all pulses of the running asynchronous transmission whose deadline
+ * has passed. Not needed on the ESP32, where the transmit timer does this.
+ */
+void RCSwitch::handleTransmit() {
+#if not defined(ESP32)
+  while (RCSwitch::bTransmitting && (long)(micros() - RCSwitch::transmitState.nDeadline) >= 0) {
+    transmitNextEdge();
+  }
+#endif
+}
+
+/**
+ * Outputs the next pulse half of the asynchronous transmission and moves the
+ * deadline to its end, following the same waveform as send().
+ *
+ * @return false once the transmission is complete
+ */
+bool RECEIVE_ATTR RCSwitch::transmitNextEdge() {
+  TransmitState &t = RCSwitch::transmitState;
+
+  if (t.nRepeatsLeft <= 0) {
+    // Disable transmit after sending (i.e., for inverted protocols)
+    digitalWrite(t.nTransmitterPin, LOW);
+    RCSwitch::bTransmitting = false;
+    return false;
+  }
+
+  const Waveform &w = t.waveform;
+  const bool secondHalf = (t.nEdge & 1) != 0;
+  digitalWrite(t.nTransmitterPin, (secondHalf != w.invertedSignal) ? LOW : HIGH);
+
+  unsigned long duration = w.durations[t.nEdge];
+  if (t.nEdge == w.nGapEdge) {
+    // pause between the data and the sync of a repeat
+    duration += w.repeatTransmitDelay * 1000UL;
+  }
+
+  if (++t.nEdge == w.nEdges) {
+    t.nEdge = 0;
+    t.nRepeatsLeft--;
+    if (t.bStopRequested && t.nRepeatsLeft > 0) {
+      t.nRepeatsSkipped = t.nRepeatsLeft;
+      t.nRepeatsLeft = 0;
+    }
+  }
+
+  t.nDeadline += duration;
+  return true;
 }
 
+#if defined(ESP32)
+/**
+ * Transmit timer interrupt: emits the next pulse half and arms the alarm for
+ * the end of it.
+ */
+void RECEIVE_ATTR RCSwitch::handleTransmitTimer() {
+  if (!transmitNextEdge())
+    return;
+
+  uint64_t alarm = RCSwitch::transmitState.nDeadline;
+  const uint64_t now = timerRead(pTransmitTimer);
+  if (alarm <= now) {
+    // Running late, catch up without moving the following deadlines
+    alarm = now + 1;
+  }
+  timerAlarmWrite(pTransmitTimer, alarm, false);
+  timerAlarmEnable(pTransmitTimer);
+}
+#endif
+
+/**
+ * Compiles the first 'length' bits of 'code' (see send()) with the current
+ * protocol into the pulse half durations of one repeat.
+ */
+void RCSwitch::compileWaveform(CodeValue code, unsigned int length, Waveform &waveform) {
+  const unsigned int maxLength = (RCSWITCH_MAX_WAVEFORM_EDGES - 4) / 2;
+  if (length > maxLength) {
+    length = maxLength;
+  }
+
+  unsigned int n = 0;
+  for (int i = length-1; i >= 0; i--) {
+    const HighLow &pulses = (code & ((CodeValue) 1 << i)) ? this->protocol.one : this->protocol.zero;
+    waveform.durations[n++] = this->protocol.pulseLength * pulses.high;
+    waveform.durations[n++] = this->protocol.pulseLength * pulses.low;
+  }
+
+  if (this->protocol.sendEndBit) {
+    waveform.durations[n++] = this->protocol.pulseLength * this->protocol.one.high;
+    waveform.durations[n++] = this->protocol.pulseLength * this->protocol.one.low;
+  }
+
+  // the repeat delay follows the data, right before the sync
+  waveform.nGapEdge = (n > 0) ? n - 1 : RCSWITCH_MAX_WAVEFORM_EDGES;
+  waveform.durations[n++] = this->protocol.pulseLength * this->protocol.syncFactor.high;
+  waveform.durations[n++] = this->protocol.pulseLength * this->protocol.syncFactor.low;
+
+  waveform.nEdges = n;
+  waveform.invertedSignal = this->protocol.invertedSignal;
+  waveform.repeatTransmitDelay = this->protocol.repeatTransmitDelay;
+}
+
+/* helper function for the waveform cache, true if both protocols produce the same waveform */
+static bool sameWaveformProtocol(const RCSwitch::Protocol &a, const RCSwitch::Protocol &b) {
+  return a.pulseLength == b.pulseLength &&
+         a.syncFactor.high == b.syncFactor.high && a.syncFactor.low == b.syncFactor.low &&
+         a.zero.high == b.zero.high && a.zero.low == b.zero.low &&
+         a.one.high == b.one.high && a.one.low == b.one.low &&
+         a.invertedSignal == b.invertedSignal &&
+         a.sendEndBit == b.sendEndBit &&
+         a.repeatTransmitDelay == b.repeatTransmitDelay;
+}
+
+/**
+ * Returns the compiled waveform for code and length with the current
+ * protocol, from the cache if possible. A miss replaces the least recently
+ * used entry.
+ */
+const RCSwitch::Waveform& RCSwitch::getWaveform(CodeValue code, unsigned int length) {
+  static unsigned long nUseCounter = 0;
+  nUseCounter++;
+
+  unsigned int lru = 0;
+  for (unsigned int i = 0; i < this->nWaveformCacheEntries; i++) {
+    WaveformCacheEntry &entry = this->waveformCache[i];
+    if (entry.code == code && entry.length == length && sameWaveformProtocol(entry.protocol, this->protocol)) {
+      this->nWaveformCacheHits++;
+      entry.nLastUsed = nUseCounter;
+      return entry.waveform;
+    }
+    if (entry.nLastUsed < this->waveformCache[lru].nLastUsed) {
+      lru = i;
+    }
+  }
+
+  this->nWaveformCacheMisses++;
+  if (this->nWaveformCacheEntries < RCSWITCH_WAVEFORM_CACHE_SIZE) {
+    lru = this->nWaveformCacheEntries++;
+  }
+
+  WaveformCacheEntry &entry = this->waveformCache[lru];
+  entry.code = code;
+  entry.length = length;
+  entry.protocol = this->protocol;
+  entry.nLastUsed = nUseCounter;
+  this->compileWaveform(code, length, entry.waveform);
+  return entry.waveform;
+}
+
+unsigned long RCSwitch::getWaveformCacheHits() {
+  return this->nWaveformCacheHits;
+}
+
+unsigned long RCSwitch::getWaveformCacheMisses() {
+  return this->nWaveformCacheMisses;
+}
 
 #if not defined( RCSwitchDisableReceiving )
 /**
@@ -558,8 +1006,10 @@ void RCSwitch::enableReceive(int interrupt) {
 
 void RCSwitch::enableReceive() {
   if (RCSwitch::nReceiverInterrupt != -1) {
-    RCSwitch::nReceivedValue = 0;
-    RCSwitch::nReceivedBitlength = 0;
+    // Codes already in the receive queue are kept, only drop edges recorded before the receiver was disabled
+    RCSwitch::nEdgeTail = RCSwitch::nEdgeHead;
+    RCSwitch::nChangeCount = 0;
+    RCSwitch::nRepeatCount = 0;
 #if defined(RaspberryPi) // Raspberry Pi
     wiringPiISR(RCSwitch::nReceiverInterrupt, INT_EDGE_BOTH, &handleInterrupt);
 #else // Arduino
@@ -579,123 +1029,469 @@ void RCSwitch::disableReceive() {
 }
 
 bool RCSwitch::available() {
-  return RCSwitch::nReceivedValue != 0;
+  this->handleReceivedEdges();
+  return RCSwitch::nReceivedTail != RCSwitch::nReceivedHead;
 }
 
+/**
+ * Removes the oldest code from the receive queue
+ */
 void RCSwitch::resetAvailable() {
-  RCSwitch::nReceivedValue = 0;
+  const unsigned int tail = RCSwitch::nReceivedTail;
+  if (tail != RCSwitch::nReceivedHead) {
+    RCSWITCH_MEMORY_BARRIER();
+    RCSwitch::nReceivedTail = (tail + 1) & (RCSWITCH_RECEIVE_QUEUE_SIZE - 1);
+  }
 }
 
-unsigned long RCSwitch::getReceivedValue() {
-  return RCSwitch::nReceivedValue;
+/**
+ * Takes the oldest code from the receive queue.
+ *
+ * This does not run the decoder, call available() or handleReceivedEdges()
+ * before draining the queue.
+ *
+ * @return false if the queue is empty
+ */
+bool RCSwitch::readReceived(ReceivedCode &code) {
+  const unsigned int tail = RCSwitch::nReceivedTail;
+  if (tail == RCSwitch::nReceivedHead) {
+    return false;
+  }
+
+  RCSWITCH_MEMORY_BARRIER();
+  code = RCSwitch::receivedCodes[tail];
+  RCSWITCH_MEMORY_BARRIER();
+  RCSwitch::nReceivedTail = (tail + 1) & (RCSWITCH_RECEIVE_QUEUE_SIZE - 1);
+  return true;
+}
+
+RCSwitch::CodeValue RCSwitch::getReceivedValue() {
+  return RCSwitch::receivedCodes[RCSwitch::nReceivedTail].value;
 }
 
 unsigned int RCSwitch::getReceivedBitlength() {
-  return RCSwitch::nReceivedBitlength;
+  return RCSwitch::receivedCodes[RCSwitch::nReceivedTail].bitlength;
 }
 
 unsigned int RCSwitch::getReceivedDelay() {
-  return RCSwitch::nReceivedDelay;
+  return RCSwitch::receivedCodes[RCSwitch::nReceivedTail].delay;
 }
 
 unsigned int RCSwitch::getReceivedProtocol() {
-  return RCSwitch::nReceivedProtocol;
+  return RCSwitch::receivedCodes[RCSwitch::nReceivedTail].protocol;
+}
+
+/**
+ * Number of decoded codes dropped because the receive queue was full.
+ */
+unsigned long RCSwitch::getDroppedCodes() {
+  return RCSwitch::nDroppedCodes;
+}
+
+/**
+ * Number of frames the protocols were tried on, decoded or not.
+ */
+unsigned long RCSwitch::getDecodeAttempts() {
+  return RCSwitch::nDecodeAttempts;
+}
+
+/**
+ * Enables or disables keeping the raw timings of repeated transmissions
+ * that no protocol could decode, see readCaptured().
+ */
+void RCSwitch::setCaptureUnknown(bool bEnable) {
+  RCSwitch::bCaptureUnknown = bEnable;
+}
+
+/**
+ * Enables or disables narrowing the receive windows of a protocol to the
+ * pulse timing learned from the frames it decoded, see Calibration.
+ * Enabled by default, the timing is learned either way.
+ */
+void RCSwitch::setCalibration(bool bEnable) {
+  RCSwitch::bCalibrate = bEnable;
+}
+
+/**
+ * Forgets the learned pulse timing of all protocols. Safe to call from
+ * another task than the decoder, the timing is cleared on the next call of
+ * handleReceivedEdges().
+ */
+void RCSwitch::resetCalibration() {
+  calibrationResetRequested = true;
+}
+
+/**
+ * Learned pulse timing of a protocol. The decoder may update it meanwhile,
+ * so the values can be from different frames.
+ *
+ * @param nProtocol   protocol number, starting with 1
+ * @return false if there is no such protocol
+ */
+bool RCSwitch::getCalibration(unsigned int nProtocol, Calibration &calibration) {
+  if (nProtocol < 1 || nProtocol > protocolCount) {
+    return false;
+  }
+
+  const ProtocolCalibration &learned = calibrations[nProtocol - 1];
+  calibration.pulseLength = learned.pulseLength / calibrationScale;
+  calibration.highOffset = learned.highOffset / calibrationScale;
+  calibration.lowOffset = learned.lowOffset / calibrationScale;
+  calibration.jitter = learned.jitter / calibrationScale;
+  calibration.frames = learned.frames;
+  return true;
+}
+
+/**
+ * Takes the oldest undecodable frame from the capture queue.
+ *
+ * @return false if the queue is empty
+ */
+bool RCSwitch::readCaptured(CapturedFrame &frame) {
+  const unsigned int tail = RCSwitch::nCapturedTail;
+  if (tail == RCSwitch::nCapturedHead) {
+    return false;
+  }
+
+  RCSWITCH_MEMORY_BARRIER();
+  const CapturedFrame &captured = RCSwitch::capturedFrames[tail];
+  frame.count = captured.count;
+  frame.timestamp = captured.timestamp;
+  memcpy(frame.timings, captured.timings, captured.count * sizeof(captured.timings[0]));
+  RCSWITCH_MEMORY_BARRIER();
+  RCSwitch::nCapturedTail = (tail + 1) & (RCSWITCH_CAPTURE_QUEUE_SIZE - 1);
+  return true;
+}
+
+/**
+ * Number of undecodable frames dropped because the capture queue was full.
+ */
+unsigned long RCSwitch::getDroppedCaptures() {
+  return RCSwitch::nDroppedCaptures;
 }
 
 unsigned int* RCSwitch::getReceivedRawdata() {
   return RCSwitch::timings;
 }
 
-/* helper function for the receiveProtocol method */
+/**
+ * Number of edges dropped because the decoder did not drain the edge buffer
+ * fast enough.
+ */
+unsigned long RCSwitch::getEdgeOverruns() {
+  return RCSwitch::nEdgeOverruns;
+}
+
+/* helper function for the receiveProtocols method */
 static inline unsigned int diff(int A, int B) {
   return abs(A - B);
 }
 
-/**
- *
+/* index of the lowest protocol set in a candidate mask */
+static inline unsigned int firstProtocol(uint32_t mask) {
+  return __builtin_ctzl((unsigned long) mask);
+}
+
+/*
+ * Per protocol state of the single pass decoder. The windows are built once
+ * per frame from the delay measured on the sync pulse.
  */
-bool RECEIVE_ATTR RCSwitch::receiveProtocol(const int p, unsigned int changeCount) {
-#if defined(ESP8266) || defined(ESP32)
-    const Protocol &pro = proto[p-1];
-#else
-    Protocol pro;
-    memcpy_P(&pro, &proto[p-1], sizeof(Protocol));
-#endif
-    
-    //const unsigned int firstSyncTiming = (pro.invertedSignal) ? (1) : (0);
-    unsigned long code = 0;
-    //Assuming the longer pulse length is the pulse captured in timings[0]
-    const unsigned int syncLengthInPulses =  ((pro.syncFactor.low) > (pro.syncFactor.high)) ? (pro.syncFactor.low) : (pro.syncFactor.high);
-    const unsigned int delay = RCSwitch::timings[pro.firstSyncTiming] / syncLengthInPulses;
-    const unsigned int delayTolerance = delay * RCSwitch::nReceiveTolerance / 100;
-    
-    /* For protocols that start low, the sync period looks like
-     *               _________
-     * _____________|         |XXXXXXXXXXXX|
-     *
-     * |--1st dur--|-2nd dur-|-Start data-|
-     *
-     * The 3rd saved duration starts the data.
-     *
-     * For protocols that start high, the sync period looks like
-     *
-     *  ______________
-     * |              |____________|XXXXXXXXXXXXX|
-     *
-     * |-filtered out-|--1st dur--|--Start data--|
-     *
-     * The 2nd saved duration starts the data
-     */
-    //const unsigned int firstDataTiming = (pro.invertedSignal) ? (3) : (1);
-    const unsigned int lastDataTiming = (pro.sendEndBit) ? changeCount - 1 : changeCount;
-    
-    for (unsigned int i = pro.firstDataTiming; i < lastDataTiming; i += 2) {
+struct ProtocolDecodeState {
+    unsigned int delay;
+    unsigned int firstDataTiming;
+    unsigned int lastDataTiming;
+    PulseWindow zeroHigh;
+    PulseWindow zeroLow;
+    PulseWindow oneHigh;
+    PulseWindow oneLow;
+    unsigned long code;
+
+    /* classifies the pulse pair at timings[i], false if it is neither a zero nor a one */
+    bool decodeBit(const unsigned int* timings, unsigned int i) {
+        const unsigned int high = timings[i];
+        const unsigned int low = timings[i + 1];
+
         code <<= 1;
-        if (diff(RCSwitch::timings[i], delay * pro.zero.high) < delayTolerance &&
-            diff(RCSwitch::timings[i + 1], delay * pro.zero.low) < delayTolerance) {
+        if (zeroHigh.matches(high) && zeroLow.matches(low)) {
             // zero
-        } else if (diff(RCSwitch::timings[i], delay * pro.one.high) < delayTolerance &&
-                   diff(RCSwitch::timings[i + 1], delay * pro.one.low) < delayTolerance) {
+            return true;
+        }
+        if (oneHigh.matches(high) && oneLow.matches(low)) {
             // one
             code |= 1;
-        } else {
-            // Failed
-            //printer->println("Failed");
-            //for (unsigned int i = 0; i < RCSWITCH_MAX_CHANGES; i++) {
-            //  printer->print( timings[i] );
-            //  printer->print(",");
-            //}
-            //printer->println("");
-            return false;
+            return true;
+        }
+        return false;
+    }
+
+#if RCSWITCH_MAX_CODE_BITS > 32
+    /*
+     * code only keeps the last bits that fit into an unsigned long, so the
+     * bits of a longer frame are classified a second time, once it matched.
+     * Frames of up to 32 bits never get here.
+     */
+    RCSwitch::CodeValue decodeWide(const unsigned int* timings) const {
+        RCSwitch::CodeValue value = 0;
+        for (unsigned int i = firstDataTiming; i < lastDataTiming; i += 2) {
+            const bool zero = zeroHigh.matches(timings[i]) && zeroLow.matches(timings[i + 1]);
+            value = (value << 1) | (zero ? 0 : 1);
         }
+        return value;
+    }
+#endif
+};
+
+// Frames a protocol has to decode before its windows are narrowed
+static const unsigned long calibrationFrames = 8;
+// Weight of the latest frame in the learned averages, once they are filled
+static const unsigned long calibrationWeight = 8;
+// Half width of a narrowed window in multiples of the learned jitter
+static const long calibrationJitterFactor = 4;
+
+/* helper function for the calibration, moves a scaled running average towards sample */
+static inline void updateAverage(long &average, long sample, unsigned long frames) {
+    // the plain mean of the first frames, then an exponential average
+    const long weight = (frames == 0) ? 1 : (frames < calibrationWeight) ? frames : calibrationWeight;
+    average += (sample - average) / weight;
+}
+
+/* helper function for the calibration, a nominal duration moved by a learned offset */
+static inline unsigned int offsetDuration(unsigned int duration, long offset) {
+    return (offset < 0 && (unsigned long) -offset > duration) ? 0 : duration + offset;
+}
+
+/*
+ * Learns the pulse timing of a protocol from a frame it decoded: the pulse
+ * length from the sync pulse, the mean deviation of the high and low halves
+ * of the data bits and their mean absolute deviation from that.
+ */
+static void calibrate(ProtocolCalibration &learned, const ProtocolDecodeState &s, const RCSwitch::Protocol &pro, const unsigned int* timings) {
+    if (s.lastDataTiming <= s.firstDataTiming) {
+        return;
+    }
+    const long bits = (s.lastDataTiming - s.firstDataTiming + 1) / 2;
+
+    long highSum = 0;
+    long lowSum = 0;
+    for (unsigned int i = s.firstDataTiming; i < s.lastDataTiming; i += 2) {
+        const bool zero = s.zeroHigh.matches(timings[i]) && s.zeroLow.matches(timings[i + 1]);
+        const RCSwitch::HighLow &factor = zero ? pro.zero : pro.one;
+        highSum += (long) timings[i] - (long) (s.delay * factor.high);
+        lowSum += (long) timings[i + 1] - (long) (s.delay * factor.low);
     }
+    const long highOffset = highSum / bits;
+    const long lowOffset = lowSum / bits;
+
+    long deviationSum = 0;
+    for (unsigned int i = s.firstDataTiming; i < s.lastDataTiming; i += 2) {
+        const bool zero = s.zeroHigh.matches(timings[i]) && s.zeroLow.matches(timings[i + 1]);
+        const RCSwitch::HighLow &factor = zero ? pro.zero : pro.one;
+        deviationSum += labs((long) timings[i] - (long) (s.delay * factor.high) - highOffset);
+        deviationSum += labs((long) timings[i + 1] - (long) (s.delay * factor.low) - lowOffset);
+    }
+
+    learned.frames++;
+    updateAverage(learned.pulseLength, (long) s.delay * calibrationScale, learned.frames);
+    updateAverage(learned.highOffset, highSum * calibrationScale / bits, learned.frames);
+    updateAverage(learned.lowOffset, lowSum * calibrationScale / bits, learned.frames);
+    updateAverage(learned.jitter, deviationSum * calibrationScale / (2 * bits), learned.frames);
+}
+
+/**
+ * Decodes the recorded timings against all protocols in a single pass.
+ *
+ * Each bit position is classified against the zero/one windows of every
+ * protocol still in the candidate mask, and a protocol is dropped as soon as
+ * one of its bits does not match, so the cost no longer grows with
+ * protocols * bits. Only the protocols whose sync pulse fits the frame
+ * are tried, see buildSyncIndex(). If several protocols match, the first
+ * one in the protocol table wins.
+ */
+bool RCSwitch::receiveProtocols(unsigned int changeCount) {
+    if (changeCount <= 7) {    // ignore very short transmissions: no device sends them, so this must be noise
+        return false;
+    }
+    RCSwitch::nDecodeAttempts++;
+
+    static ProtocolDecodeState state[RCSWITCH_MAX_PROTOCOLS];
+    uint32_t candidates = syncIndex[0][syncBucket(RCSwitch::timings[0])] | syncIndex[1][syncBucket(RCSwitch::timings[1])];
+
+    for (uint32_t pending = candidates; pending != 0; pending &= pending - 1) {
+        const unsigned int p = firstProtocol(pending);
+        const Protocol &pro = protocolTable[p];
+        ProtocolDecodeState &s = state[p];
+
+        //Assuming the longer pulse length is the pulse captured in timings[0]
+        const unsigned int syncLengthInPulses =  ((pro.syncFactor.low) > (pro.syncFactor.high)) ? (pro.syncFactor.low) : (pro.syncFactor.high);
+        const unsigned int delay = RCSwitch::timings[pro.firstSyncTiming] / syncLengthInPulses;
+        unsigned int delayTolerance = delay * RCSwitch::nReceiveTolerance / 100;
+        s.delay = delay;
+
+        // Once the protocol is calibrated, center the windows on the learned
+        // timing and narrow them to its jitter, to at most half their width
+        long highOffset = 0;
+        long lowOffset = 0;
+        const ProtocolCalibration &learned = calibrations[p];
+        if (RCSwitch::bCalibrate && learned.frames >= calibrationFrames) {
+            const unsigned int jitterTolerance = learned.jitter * calibrationJitterFactor / calibrationScale + 1;
+            if (jitterTolerance < delayTolerance) {
+                delayTolerance = (jitterTolerance > delayTolerance / 2) ? jitterTolerance : delayTolerance / 2;
+            }
+            highOffset = learned.highOffset / calibrationScale;
+            lowOffset = learned.lowOffset / calibrationScale;
+        }
+
+        /* For protocols that start low, the sync period looks like
+         *               _________
+         * _____________|         |XXXXXXXXXXXX|
+         *
+         * |--1st dur--|-2nd dur-|-Start data-|
+         *
+         * The 3rd saved duration starts the data.
+         *
+         * For protocols that start high, the sync period looks like
+         *
+         *  ______________
+         * |              |____________|XXXXXXXXXXXXX|
+         *
+         * |-filtered out-|--1st dur--|--Start data--|
+         *
+         * The 2nd saved duration starts the data
+         */
+        s.firstDataTiming = pro.firstDataTiming;
+        // The last duration is the high half of the end bit or of the sync
+        // that follows the data, its low half is the gap
+        s.lastDataTiming = changeCount - 1;
+        s.zeroHigh.set(offsetDuration(delay * pro.zero.high, highOffset), delayTolerance);
+        s.zeroLow.set(offsetDuration(delay * pro.zero.low, lowOffset), delayTolerance);
+        s.oneHigh.set(offsetDuration(delay * pro.one.high, highOffset), delayTolerance);
+        s.oneLow.set(offsetDuration(delay * pro.one.low, lowOffset), delayTolerance);
+        s.code = 0;
+    }
+
+    // Protocols which still have bits left to classify
+    uint32_t active = candidates;
+
+    for (unsigned int offset = 0; active != 0; offset += 2) {
+        if ((active & (active - 1)) == 0) {
+            // Only one protocol left, finish it without the mask bookkeeping
+            const unsigned int p = firstProtocol(active);
+            ProtocolDecodeState &s = state[p];
+            for (unsigned int i = s.firstDataTiming + offset; i < s.lastDataTiming; i += 2) {
+                if (!s.decodeBit(RCSwitch::timings, i)) {
+                    candidates &= ~((uint32_t) 1 << p);
+                    break;
+                }
+            }
+            break;
+        }
+
+        for (uint32_t pending = active; pending != 0; pending &= pending - 1) {
+            const unsigned int p = firstProtocol(pending);
+            ProtocolDecodeState &s = state[p];
+            const unsigned int i = s.firstDataTiming + offset;
+
+            if (i >= s.lastDataTiming) {
+                // all bits matched
+                active &= ~((uint32_t) 1 << p);
+            } else if (!s.decodeBit(RCSwitch::timings, i)) {
+                // Failed
+                candidates &= ~((uint32_t) 1 << p);
+                active &= ~((uint32_t) 1 << p);
+            }
+        }
+    }
+
+    if (candidates == 0) {
+        return false;
+    }
+
+    const unsigned int p = firstProtocol(candidates);
+
+    calibrate(calibrations[p], state[p], protocolTable[p], RCSwitch::timings);
 
-    //for (unsigned int i = 0; i < RCSWITCH_MAX_CHANGES; i++) {
-    //  printer->print( timings[i] );
-    //  printer->print(",");
-    //}
-
-    //printer->println(changeCount);
-    if (changeCount > 7) {    // ignore very short transmissions: no device sends them, so this must be noise
-        RCSwitch::nReceivedValue = code;
-        RCSwitch::nReceivedBitlength = (changeCount - 1) / 2;
-        RCSwitch::nReceivedDelay = delay;
-        RCSwitch::nReceivedProtocol = p;
+    const unsigned int head = RCSwitch::nReceivedHead;
+    const unsigned int next = (head + 1) & (RCSWITCH_RECEIVE_QUEUE_SIZE - 1);
+    if (next == RCSwitch::nReceivedTail) {
+        // The code was valid, but there is no room left to store it
+        RCSwitch::nDroppedCodes++;
         return true;
     }
 
-    return false;
+    ReceivedCode &received = RCSwitch::receivedCodes[head];
+    received.value = state[p].code;
+    received.bitlength = (changeCount - 1) / 2;
+#if RCSWITCH_MAX_CODE_BITS > 32
+    if (received.bitlength > 32) {
+        received.value = state[p].decodeWide(RCSwitch::timings);
+    }
+#endif
+    received.delay = state[p].delay;
+    received.protocol = p + 1;
+    received.timestamp = millis();
+    RCSWITCH_MEMORY_BARRIER();
+    RCSwitch::nReceivedHead = next;
+    return true;
 }
 
-void RECEIVE_ATTR RCSwitch::handleInterrupt() {
-  bool rising = digitalRead(RCSwitch::nReceiverInterrupt);
-  static unsigned int changeCount = 0;
-  static unsigned long lastTime = 0;
-  static unsigned int repeatCount = 0;
+/**
+ * Copies the recorded timings of a frame no protocol matched into the
+ * capture queue.
+ */
+void RCSwitch::captureFrame(unsigned int changeCount) {
+    if (changeCount <= 7) {    // same noise filter as receiveProtocols()
+        return;
+    }
+
+    const unsigned int head = RCSwitch::nCapturedHead;
+    const unsigned int next = (head + 1) & (RCSWITCH_CAPTURE_QUEUE_SIZE - 1);
+    if (next == RCSwitch::nCapturedTail) {
+        RCSwitch::nDroppedCaptures++;
+        return;
+    }
 
-  const long time = micros();
-  const unsigned int duration = time - lastTime;
+    CapturedFrame &frame = RCSwitch::capturedFrames[head];
+    memcpy(frame.timings, RCSwitch::timings, changeCount * sizeof(RCSwitch::timings[0]));
+    frame.count = changeCount;
+    frame.timestamp = millis();
+    RCSWITCH_MEMORY_BARRIER();
+    RCSwitch::nCapturedHead = next;
+}
+
+/**
+ * Decoder stage: drains the edges recorded by handleInterrupt() and runs the
+ * protocol detection outside of interrupt context. Called by available(), so
+ * it only needs to be called directly when available() is not polled.
+ */
+void RCSwitch::handleReceivedEdges() {
+  static unsigned long lastOverruns = 0;
+
+  RCSwitch::applyLoadedProtocols();
+  if (calibrationResetRequested) {
+    memset(calibrations, 0, sizeof(calibrations));
+    calibrationResetRequested = false;
+  }
+
+  if (RCSwitch::nEdgeOverruns != lastOverruns) {
+    // Edges were lost, the partially recorded transmission is useless
+    lastOverruns = RCSwitch::nEdgeOverruns;
+    RCSwitch::nChangeCount = 0;
+    RCSwitch::nRepeatCount = 0;
+  }
 
+  unsigned int tail = RCSwitch::nEdgeTail;
+  while (tail != RCSwitch::nEdgeHead) {
+    RCSWITCH_MEMORY_BARRIER();
+    const unsigned int edge = RCSwitch::edges[tail];
+    RCSWITCH_MEMORY_BARRIER();
+    tail = (tail + 1) & (RCSWITCH_EDGE_BUFFER_SIZE - 1);
+    RCSwitch::nEdgeTail = tail;
+
+    decodeEdge(edge & ~EDGE_RISING, (edge & EDGE_RISING) != 0);
+  }
+}
+
+void RCSwitch::decodeEdge(unsigned int duration, bool rising) {
   if (duration > RCSwitch::nSeparationLimit && rising) {
     // A long stretch without signal level change occurred. This could
     // be the gap between two transmission.
@@ -705,27 +1501,56 @@ void RECEIVE_ATTR RCSwitch::handleInterrupt() {
       // it may indeed by a a gap between two transmissions (we assume
       // here that a sender will send the signal multiple times,
       // with roughly the same gap between them).
-      repeatCount++;
-      if (repeatCount == 2) {
-        for(unsigned int i = 1; i <= numProto; i++) {
-          if (receiveProtocol(i, changeCount)) {
-            // receive succeeded for protocol i
-            break;
-          }
+      RCSwitch::nRepeatCount++;
+      if (RCSwitch::nRepeatCount == 2) {
+        if (!receiveProtocols(RCSwitch::nChangeCount) && RCSwitch::bCaptureUnknown) {
+          captureFrame(RCSwitch::nChangeCount);
         }
-        repeatCount = 0;
+        RCSwitch::nRepeatCount = 0;
       }
     }
-    changeCount = 0;
+    RCSwitch::nChangeCount = 0;
   }
  
   // detect overflow
-  if (changeCount >= RCSWITCH_MAX_CHANGES) {
-    changeCount = 0;
-    repeatCount = 0;
+  if (RCSwitch::nChangeCount >= RCSWITCH_MAX_CHANGES) {
+    RCSwitch::nChangeCount = 0;
+    RCSwitch::nRepeatCount = 0;
+  }
+
+  RCSwitch::timings[RCSwitch::nChangeCount++] = duration;
+}
+
+/**
+ * Receive interrupt: only records the duration since the previous edge, the
+ * decoding is deferred to handleReceivedEdges().
+ */
+void RECEIVE_ATTR RCSwitch::handleInterrupt() {
+  const bool rising = digitalRead(RCSwitch::nReceiverInterrupt);
+  static unsigned long lastTime = 0;
+
+  const unsigned long time = micros();
+  unsigned long duration = time - lastTime;
+  lastTime = time;
+
+  if (RCSwitch::bTransmitting) {
+    // our own transmission, see sendAsync()
+    return;
+  }
+
+  if (duration >= EDGE_RISING) {
+    duration = EDGE_RISING - 1;
+  }
+
+  const unsigned int head = RCSwitch::nEdgeHead;
+  const unsigned int next = (head + 1) & (RCSWITCH_EDGE_BUFFER_SIZE - 1);
+  if (next == RCSwitch::nEdgeTail) {
+    RCSwitch::nEdgeOverruns++;
+    return;
   }
 
-  RCSwitch::timings[changeCount++] = duration;
-  lastTime = time;  
+  RCSwitch::edges[head] = duration | (rising ? EDGE_RISING : 0);
+  RCSWITCH_MEMORY_BARRIER();
+  RCSwitch::nEdgeHead = next;
 }
 #endif
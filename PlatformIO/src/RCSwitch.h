@@ -56,13 +56,70 @@
 #define RCSwitchDisableReceiving
 #endif
 
+// Longest code that can be received and sent, at most 64. Above 32 bits
+// codes are held in a uint64_t, the 32 bit build keeps unsigned long.
+#ifndef RCSWITCH_MAX_CODE_BITS
+#define RCSWITCH_MAX_CODE_BITS 32
+#endif
+#if RCSWITCH_MAX_CODE_BITS > 64
+#error "RCSWITCH_MAX_CODE_BITS must not be larger than 64"
+#endif
+
 // Number of maximum high/Low changes per packet.
-// We can handle up to (unsigned long) => 32 bit * 2 H/L changes per bit + 2 for sync
-#define RCSWITCH_MAX_CHANGES 67
+// 2 H/L changes per bit + gap, sync and end bit of protocols that start high
+#define RCSWITCH_MAX_CHANGES (RCSWITCH_MAX_CODE_BITS * 2 + 4)
+
+// Number of raw edge durations buffered between the receive interrupt and
+// the decoder. Must be a power of two.
+#ifndef RCSWITCH_EDGE_BUFFER_SIZE
+#define RCSWITCH_EDGE_BUFFER_SIZE 256
+#endif
+
+// Number of decoded codes buffered until they are read. Must be a power of two.
+#ifndef RCSWITCH_RECEIVE_QUEUE_SIZE
+#define RCSWITCH_RECEIVE_QUEUE_SIZE 16
+#endif
+
+// Number of undecodable frames buffered for capture until they are read.
+// Must be a power of two.
+#ifndef RCSWITCH_CAPTURE_QUEUE_SIZE
+#define RCSWITCH_CAPTURE_QUEUE_SIZE 4
+#endif
+
+// Maximum number of pulse halves in one repeat of a transmission:
+// data bits + end bit + sync, 2 halves each
+#define RCSWITCH_MAX_WAVEFORM_EDGES (RCSWITCH_MAX_CODE_BITS * 2 + 4)
+
+// Size of the protocol table, at most 32 as the decoder tracks the
+// candidates in a 32 bit mask
+#ifndef RCSWITCH_MAX_PROTOCOLS
+#define RCSWITCH_MAX_PROTOCOLS 32
+#endif
+
+// Longest repeat delay of a protocol in milliseconds. The transmitter adds
+// it in microseconds to a 32 bit deadline, far below 2^32 / 1000.
+#define RCSWITCH_MAX_REPEAT_DELAY 60000
+
+// Number of compiled waveforms kept for repeated sends
+#ifndef RCSWITCH_WAVEFORM_CACHE_SIZE
+#define RCSWITCH_WAVEFORM_CACHE_SIZE 8
+#endif
+
+// Hardware timer used by sendAsync() on the ESP32
+#ifndef RCSWITCH_TRANSMIT_TIMER
+#define RCSWITCH_TRANSMIT_TIMER 0
+#endif
 
 class RCSwitch {
 
   public:
+    /** Holds a code of up to RCSWITCH_MAX_CODE_BITS bits */
+    #if RCSWITCH_MAX_CODE_BITS > 32
+    typedef uint64_t CodeValue;
+    #else
+    typedef unsigned long CodeValue;
+    #endif
+
     RCSwitch();
     
     void switchOn(int nGroupNumber, int nSwitchNumber);
@@ -77,9 +134,16 @@ class RCSwitch {
     void switchOff(char sGroup, int nDevice);
 
     void sendTriState(const char* sCodeWord);
-    void triStateGetCodeAndLength(const char* sCodeWord, unsigned long &code, unsigned int &length);
-    void send(unsigned long code, unsigned int length);
+    void triStateGetCodeAndLength(const char* sCodeWord, CodeValue &code, unsigned int &length);
+    void send(CodeValue code, unsigned int length);
     void send(const char* sCodeWord);
+    bool sendAsync(CodeValue code, unsigned int length);
+    bool isTransmitting();
+    void handleTransmit();
+    void stopTransmitAfterRepeat();
+    int getSkippedRepeats();
+    unsigned long getWaveformCacheHits();
+    unsigned long getWaveformCacheMisses();
     
     #if not defined( RCSwitchDisableReceiving )
     void enableReceive(int interrupt);
@@ -87,12 +151,18 @@ class RCSwitch {
     void disableReceive();
     bool available();
     void resetAvailable();
+    void handleReceivedEdges();
+    unsigned long getEdgeOverruns();
 
-    unsigned long getReceivedValue();
+    CodeValue getReceivedValue();
     unsigned int getReceivedBitlength();
     unsigned int getReceivedDelay();
     unsigned int getReceivedProtocol();
     unsigned int* getReceivedRawdata();
+    unsigned long getDroppedCodes();
+    unsigned long getDecodeAttempts();
+    void setCaptureUnknown(bool bEnable);
+    unsigned long getDroppedCaptures();
     #endif
   
     void enableTransmit(int nTransmitterPin);
@@ -149,9 +219,83 @@ class RCSwitch {
         unsigned int firstDataTiming;
     };
 
+    /**
+     * One repeat of a transmission compiled into the durations of its pulse
+     * halves in microseconds. The levels alternate, starting with the first
+     * logic level of the protocol. The repeat delay of the protocol is
+     * appended to the pulse half with the index nGapEdge, right before the
+     * sync.
+     */
+    struct Waveform {
+        unsigned int durations[RCSWITCH_MAX_WAVEFORM_EDGES];
+        uint8_t nEdges;
+        uint8_t nGapEdge;
+        bool invertedSignal;
+        unsigned int repeatTransmitDelay;
+    };
+
+    /**
+     * A decoded transmission as stored in the receive queue.
+     */
+    struct ReceivedCode {
+        CodeValue value;
+        unsigned int bitlength;
+        unsigned int delay;
+        unsigned int protocol;
+        /** millis() at the time the code was decoded */
+        unsigned long timestamp;
+    };
+
+    /**
+     * Raw timings of a repeated transmission that none of the protocols
+     * could decode. timings[0] is the gap before the transmission, which
+     * ends with a rising edge, the following durations alternate between
+     * high and low.
+     */
+    struct CapturedFrame {
+        unsigned int timings[RCSWITCH_MAX_CHANGES];
+        unsigned int count;
+        /** millis() at the time the frame was captured */
+        unsigned long timestamp;
+    };
+
+    /**
+     * Pulse timing of a protocol learned from the frames it decoded, in
+     * microseconds. Once enough frames were seen, the decoder centers the
+     * windows of the protocol on these values and narrows them to the
+     * jitter, see setCalibration().
+     */
+    struct Calibration {
+        /** average base pulse length, measured on the sync pulse. Only reported, the windows use the pulse length of each frame */
+        unsigned int pulseLength;
+        /** average deviation of the high and low halves of the data bits from their nominal length, e.g. receiver skew */
+        int highOffset;
+        int lowOffset;
+        /** average absolute deviation of a pulse half from its calibrated length */
+        unsigned int jitter;
+        /** number of frames learned from */
+        unsigned long frames;
+    };
+
+    #if not defined( RCSwitchDisableReceiving )
+    bool readReceived(ReceivedCode &code);
+    bool readCaptured(CapturedFrame &frame);
+    void setCalibration(bool bEnable);
+    void resetCalibration();
+    bool getCalibration(unsigned int nProtocol, Calibration &calibration);
+    #endif
+
+    void compileWaveform(CodeValue code, unsigned int length, Waveform &waveform);
+
     void setProtocol(Protocol protocol);
     void setProtocol(int nProtocol);
     void setProtocol(int nProtocol, int nPulseLength);
+    static unsigned int getProtocolCount();
+    static bool getProtocol(unsigned int nProtocol, Protocol &protocol);
+    static bool getBuiltInProtocol(unsigned int nProtocol, Protocol &protocol);
+    static bool isValidProtocol(const Protocol &protocol);
+    static bool loadProtocols(const Protocol* table, unsigned int count);
+    static bool isLoadingProtocols();
 
     char* getCodeWordA(const char* sGroup, const char* sDevice, bool bStatus);
     char* getCodeWordB(int nGroupNumber, int nSwitchNumber, bool bStatus);
@@ -159,11 +303,18 @@ class RCSwitch {
     char* getCodeWordD(char group, int nDevice, bool bStatus);
 
   private:
-    void transmit(HighLow pulses);
+    const Waveform& getWaveform(CodeValue code, unsigned int length);
+    static void applyLoadedProtocols();
+    static bool transmitNextEdge();
+    #if defined(ESP32)
+    static void handleTransmitTimer();
+    #endif
 
     #if not defined( RCSwitchDisableReceiving )
     static void handleInterrupt();
-    static bool receiveProtocol(const int p, unsigned int changeCount);
+    static void decodeEdge(unsigned int duration, bool rising);
+    static bool receiveProtocols(unsigned int changeCount);
+    static void captureFrame(unsigned int changeCount);
     static int nReceiverInterrupt;
     #endif
     int nTransmitterPin;
@@ -171,17 +322,85 @@ class RCSwitch {
     
     Protocol protocol;
 
+    /*
+     * Least recently used cache of compiled waveforms, keyed by code, length
+     * and the protocol they were compiled with.
+     */
+    struct WaveformCacheEntry {
+        CodeValue code;
+        unsigned int length;
+        Protocol protocol;
+        unsigned long nLastUsed;
+        Waveform waveform;
+    };
+    WaveformCacheEntry waveformCache[RCSWITCH_WAVEFORM_CACHE_SIZE];
+    unsigned int nWaveformCacheEntries;
+    unsigned long nWaveformCacheHits;
+    unsigned long nWaveformCacheMisses;
+
+    /*
+     * State of the transmission started by sendAsync(). There is only one
+     * transmit timer, so it is shared by all instances.
+     */
+    struct TransmitState {
+        Waveform waveform;
+        int nTransmitterPin;
+        unsigned int nEdge;
+        int nRepeatsLeft;
+        /* set by stopTransmitAfterRepeat(), checked at the end of every repeat */
+        volatile bool bStopRequested;
+        /* repeats that were not sent because of bStopRequested */
+        int nRepeatsSkipped;
+        /* end of the current pulse half in microseconds */
+    #if defined(ESP32)
+        uint64_t nDeadline;
+    #else
+        unsigned long nDeadline;
+    #endif
+    };
+    static TransmitState transmitState;
+    volatile static bool bTransmitting;
+
     #if not defined( RCSwitchDisableReceiving )
     static int nReceiveTolerance;
-    volatile static unsigned long nReceivedValue;
-    volatile static unsigned int nReceivedBitlength;
-    volatile static unsigned int nReceivedDelay;
-    volatile static unsigned int nReceivedProtocol;
+    /*
+     * Single producer (decoder) / single consumer ring of decoded codes.
+     * available() and getReceived*() refer to the oldest entry,
+     * resetAvailable() removes it.
+     */
+    static ReceivedCode receivedCodes[RCSWITCH_RECEIVE_QUEUE_SIZE];
+    volatile static unsigned int nReceivedHead;
+    volatile static unsigned int nReceivedTail;
+    volatile static unsigned long nDroppedCodes;
+    volatile static unsigned long nDecodeAttempts;
     const static unsigned int nSeparationLimit;
     /* 
      * timings[0] contains sync timing, followed by a number of bits
      */
     static unsigned int timings[RCSWITCH_MAX_CHANGES];
+
+    /*
+     * Single producer (decoder) / single consumer ring of frames no protocol
+     * matched, only filled while setCaptureUnknown(true).
+     */
+    static CapturedFrame capturedFrames[RCSWITCH_CAPTURE_QUEUE_SIZE];
+    volatile static unsigned int nCapturedHead;
+    volatile static unsigned int nCapturedTail;
+    volatile static unsigned long nDroppedCaptures;
+    static bool bCaptureUnknown;
+    static bool bCalibrate;
+
+    /*
+     * Single producer (handleInterrupt) / single consumer (handleReceivedEdges)
+     * ring of raw edge durations. The level after the edge is stored in the
+     * most significant bit.
+     */
+    static unsigned int edges[RCSWITCH_EDGE_BUFFER_SIZE];
+    volatile static unsigned int nEdgeHead;
+    volatile static unsigned int nEdgeTail;
+    volatile static unsigned long nEdgeOverruns;
+    static unsigned int nChangeCount;
+    static unsigned int nRepeatCount;
     #endif
 
     
@@ -0,0 +1,68 @@
+/*
+  Lock-free FIFO between exactly one producer and one consumer, e.g. two
+  tasks on different cores or an interrupt and a task.
+
+  Only the producer writes nTail and only the consumer writes nHead, so
+  neither side ever waits for the other. Size must be a power of two, one
+  slot stays free to tell a full queue from an empty one.
+*/
+#ifndef _SpscQueue_h
+#define _SpscQueue_h
+
+// Keeps the compiler and the other core from seeing an index update before
+// the item it publishes
+#define SPSCQUEUE_MEMORY_BARRIER() __sync_synchronize()
+
+template <typename T, unsigned int Size>
+class SpscQueue {
+
+  static_assert((Size & (Size - 1)) == 0, "SpscQueue size must be a power of two");
+
+  public:
+    SpscQueue() : nHead(0), nTail(0), nDropped(0) {}
+
+    // Producer side, false (and counted) if the queue is full
+    bool push(const T &item) {
+      const unsigned int tail = this->nTail;
+      const unsigned int next = (tail + 1) & (Size - 1);
+      if (next == this->nHead) {
+        this->nDropped++;
+        return false;
+      }
+
+      this->items[tail] = item;
+      SPSCQUEUE_MEMORY_BARRIER();
+      this->nTail = next;
+      return true;
+    }
+
+    // Consumer side, false if the queue is empty
+    bool pop(T &item) {
+      const unsigned int head = this->nHead;
+      if (head == this->nTail) {
+        return false;
+      }
+
+      SPSCQUEUE_MEMORY_BARRIER();
+      item = this->items[head];
+      SPSCQUEUE_MEMORY_BARRIER();
+      this->nHead = (head + 1) & (Size - 1);
+      return true;
+    }
+
+    // Free slots as seen by the producer, the consumer can only add to them
+    unsigned int space() const {
+      return (this->nHead - this->nTail - 1) & (Size - 1);
+    }
+
+    // Number of items rejected because the queue was full
+    unsigned long getDropped() const { return this->nDropped; }
+
+  private:
+    T items[Size];
+    volatile unsigned int nHead;
+    volatile unsigned int nTail;
+    volatile unsigned long nDropped;
+};
+
+#endif
@@ -1,10 +1,13 @@
 #include "Arduino.h"
 #include "RCSwitch.h"
+#include "Gateway.h"
+#include "PulseCapture.h"
+#include "ProtocolLearner.h"
+#include "SpscQueue.h"
 #include <WiFi.h>
 #include <WiFiClient.h>
 #include <PubSubClient.h>
 #include <ESPmDNS.h>
-#include <QueueList.h>
 #include <WiFiManager.h>
 #include <ArduinoJson.h>
 #include <Ticker.h>
@@ -13,8 +16,9 @@
 #include <WiFiUdp.h>
 #include <ArduinoOTA.h>
 
-#define ESP_DRD_USE_EEPROM false
-#define ESP_DRD_USE_SPIFFS true
+// EEPROM keeps SPIFFS out of the boot path
+#define ESP_DRD_USE_EEPROM true
+#define ESP_DRD_USE_SPIFFS false
 
 #include <ESP_DoubleResetDetector.h>
 
@@ -22,7 +26,7 @@
 // subseqent reset will be considered a double reset.
 #define DRD_TIMEOUT 10
 
-// RTC Memory Address for the DoubleResetDetector to use
+// EEPROM Address for the DoubleResetDetector to use
 #define DRD_ADDRESS 0
 
 DoubleResetDetector* drd;
@@ -55,330 +59,1795 @@ int transmitPin = 32;
 bool otaUpdateRunning = false;
 uint8_t otaProgress = 0;
 
-// MQTT Topics
-String deviceTopic;
-String willTopic;
+// MQTT Topics, built once in readConfig()
+const size_t maxTopicLength = 96;
+
+char deviceTopic[maxTopicLength];
+size_t deviceTopicLength = 0;
+char willTopic[maxTopicLength];
+char subscribeTopic[maxTopicLength];
+
+char systemNodeTopic[maxTopicLength];
+char senderNodeTopic[maxTopicLength];
+char receiverNodeTopic[maxTopicLength];
+
+char rssiPropertyTopic[maxTopicLength];
+char statsPropertyTopic[maxTopicLength];
+char logPropertyTopic[maxTopicLength];
+char resetPropertyTopic[maxTopicLength];
+
+char sendTypeAPropertyTopic[maxTopicLength];
+char sendPropertyTopic[maxTopicLength];
+char sendBatchPropertyTopic[maxTopicLength];
+char sendBinPropertyTopic[maxTopicLength];
+
+char queueLengthPropertyTopic[maxTopicLength];
+char codeReceivedPropertyTopic[maxTopicLength];
+char codeAgePropertyTopic[maxTopicLength];
+char capturePropertyTopic[maxTopicLength];
+char captureDataPropertyTopic[maxTopicLength];
+char dedupPropertyTopic[maxTopicLength];
+char pressPropertyTopic[maxTopicLength];
+char calibrationPropertyTopic[maxTopicLength];
+char protocolsPropertyTopic[maxTopicLength];
+char learnPropertyTopic[maxTopicLength];
+char learnedPropertyTopic[maxTopicLength];
+char fingerprintTopic[maxTopicLength];
+
+// Largest MQTT message sent or received
+const uint16_t mqttBufferSize = 2048;
+static_assert(PULSECAPTURE_BUFFER_SIZE + 128 <= mqttBufferSize, "capture batches do not fit into an MQTT message");
 
-String systemNodeTopic;
-String senderNodeTopic;
-String receiverNodeTopic;
+unsigned long rssiTimer = 0;
+const unsigned long rssiTimeout = 60000;
+
+// Recording of frames no protocol could decode
+enum CaptureMode { CAPTURE_OFF, CAPTURE_FILE, CAPTURE_MQTT };
+const char* captureModeNames[] = { "off", "file", "mqtt" };
+CaptureMode captureMode = CAPTURE_OFF;
+
+PulseCaptureBuffer captureBuffer;
+unsigned long captureTimer = 0;
+// Maximum time a captured frame waits in RAM before it is written out
+const unsigned long captureFlushTimeout = 5000;
+
+// Derives a protocol from frames no protocol could decode while receiver/learn is on
+ProtocolLearner protocolLearner;
+bool learning = false;
+unsigned long learnTimer = 0;
+// Learning stops when no protocol was found in this time
+const unsigned long learnTimeout = 120000;
+
+const char* captureFileName = "/capture.bin";
+const char* captureOldFileName = "/capture.old.bin";
+const size_t maxCaptureFileSize = 65536;
+
+bool spiffsMounted = false;
+
+/*
+ * Copy of the configuration and of the last Wi-Fi connection that survives a
+ * software reset, so a restart needs neither SPIFFS nor a scan or DHCP. RTC
+ * memory is random after power on, the magic and the CRC tell a valid copy
+ * apart. Change the magic when the layout changes.
+ */
+const uint32_t bootCacheMagic = 0x52435333;
+
+struct BootCache {
+  uint32_t magic;
+  char hostname[40];
+  char mqttServer[40];
+  char mqttPort[6];
+  uint8_t bssid[6];
+  int32_t channel;
+  uint32_t localIP;
+  uint32_t gatewayIP;
+  uint32_t subnetMask;
+  uint32_t dnsIP;
+  // Milliseconds the address was used without DHCP, over the fast boots in a row
+  uint32_t staticAddressTime;
+  // Whether /protocols.json replaces the built-in protocols
+  bool customProtocols;
+  uint32_t crc;
+};
+
+RTC_NOINIT_ATTR BootCache bootCache;
+bool fastBoot = false;
+
+// Longest wait for the access point of the last boot before a normal connect
+const unsigned long fastConnectTimeout = 3000;
+// Longest time the cached address is used without DHCP. Its lease was
+// renewed by DHCP before, so it is still valid for at least half of a
+// common lease time.
+const unsigned long maxStaticAddressTime = 30 * 60000UL;
+// Whether the connection uses the cached address instead of a DHCP lease,
+// and for how long it was used like that before this boot
+bool staticAddress = false;
+unsigned long staticAddressBase = 0;
+bool wifiLeaseChanged = false;
+// Interval of the time on the cached address kept in the boot cache
+unsigned long staticAddressTimer = 0;
+const unsigned long staticAddressInterval = 60000;
+
+/*
+ * The RF task owns the transmitter, the decoder and the send scheduler, the
+ * network task everything else. They only share these lock-free queues, the
+ * capture ring of RCSwitch (read by the network task) and word sized
+ * counters that are read for the statistics.
+ */
+const uint32_t rfTaskStackSize = 4096;
+const uint32_t networkTaskStackSize = 8192;
+// Above the network task, the RF work is short and latency sensitive
+const UBaseType_t rfTaskPriority = 3;
+const UBaseType_t networkTaskPriority = 1;
+// APP_CPU, the protocol core runs the Wi-Fi stack next to the network task
+const BaseType_t rfTaskCore = 1;
+const BaseType_t networkTaskCore = 0;
+
+// Send commands to the RF task, room for more than a full batch
+SpscQueue<CodeQueueItem, 64> radioCommands;
+// Received codes from the RF task
+SpscQueue<RCSwitch::ReceivedCode, 64> radioEvents;
+// scheduler.count() as last seen by the RF task
+volatile unsigned int radioQueueLength = 0;
+// Free slots per send queue as last seen by the RF task, and the commands
+// per class it had taken from radioCommands by then, see submitCodes()
+volatile unsigned int radioQueueRoom[priorityCount] = { maxQueueCount, maxQueueCount, maxQueueCount };
+volatile unsigned long radioTakenCodes[priorityCount];
+// Commands per class handed to radioCommands, only the network task writes it
+unsigned long submittedCodes[priorityCount];
+unsigned int publishedQueueLength = ~0u;
+
+// Time a task spent working, without its waits between rounds
+struct TaskTime {
+  volatile unsigned long busyMicros;
+  unsigned long reportedMicros;
+};
+TaskTime rfTaskTime = { 0, 0 };
+TaskTime networkTaskTime = { 0, 0 };
+unsigned long taskTimeTimer = 0;
+
+// Merges the repeated frames of a button press into one event
+ReceiveDeduplicator receiveDedup;
+// Whether every ended press is published, see setDedup()
+bool dedupPressInfo = false;
+// Longer than the gap between the repeats of common remotes and smoke detectors
+const unsigned long defaultHoldOff = 300;
+
+// Whether the decoder narrows its windows to the learned pulse timing
+bool calibrationEnabled = true;
+
+// The retained receiver settings are published again after every connect, the broker may have lost them
+bool settingsPending = false;
+
+// Protocol table set via receiver/protocols, kept across restarts
+const char* protocolsFileName = "/protocols.json";
+bool customProtocols = false;
+// The protocol table changed and is published once the RF task uses it, also after startup
+bool protocolsChanged = true;
+// Built-in protocol of Type A switches, a loaded table without it gets it appended
+const unsigned int typeABuiltInProtocol = 1;
+// Number of the Type A protocol in the table in use, and in the table handed to the RF task
+unsigned int typeAProtocol = typeABuiltInProtocol;
+unsigned int loadedTypeAProtocol = typeABuiltInProtocol;
+// Every protocol is an array like [350, [1, 31], [1, 3], [3, 1], false, false, 0, 0, 1]
+const size_t protocolsDocSize = JSON_ARRAY_SIZE(RCSWITCH_MAX_PROTOCOLS) + RCSWITCH_MAX_PROTOCOLS * (JSON_ARRAY_SIZE(9) + 3 * JSON_ARRAY_SIZE(2));
+
+// Received codes waiting to be published, e.g. while MQTT is down
+EventBuffer pendingEvents;
+unsigned long eventFlushTimer = 0;
+// Minimum time between two published codes, lets a backlog drain without flooding the broker
+const unsigned long eventFlushInterval = 10;
+
+unsigned long eventsPublished = 0;
+unsigned long eventLatencyTotal = 0;
+unsigned long eventLatencyMax = 0;
+
+#if defined(EVENT_SPILL) && EVENT_SPILL
+// Codes that overflow pendingEvents, oldest first
+const char* eventSpillFileName = "/events.bin";
+const size_t maxEventSpillFileSize = 16384;
+size_t spillReadOffset = 0;
+#endif
+// Codes in the spill file, total ever spilled and lost with an unreadable file
+unsigned int spilledEvents = 0;
+unsigned long eventsSpilled = 0;
+unsigned long eventsDroppedSpill = 0;
+
+// Wi-Fi and MQTT reconnect with exponential backoff, loop() steps them without blocking
+const unsigned long minReconnectDelay = 1000;
+const unsigned long maxReconnectDelay = 60000;
+// A Wi-Fi join that takes longer counts as failed
+const unsigned long wifiConnectTimeout = 10000;
+// Seconds a single MQTT connect may block
+const uint16_t mqttSocketTimeout = 2;
+
+struct Reconnect {
+  // Start of the current join or of the wait after a failure
+  unsigned long timer;
+  // Wait before the next attempt, 0 right after a success
+  unsigned long delay;
+};
+
+// setup() connects Wi-Fi before the loop runs
+enum WifiState { WIFI_STATE_UP, WIFI_STATE_WAITING, WIFI_STATE_JOINING };
+WifiState wifiState = WIFI_STATE_UP;
+Reconnect wifiReconnect = { 0, 0 };
+Reconnect mqttReconnect = { 0, 0 };
+
+// millis() at the end of each boot phase
+enum BootPhase { BOOT_CONFIG, BOOT_WIFI, BOOT_MQTT };
+const unsigned int bootPhaseCount = BOOT_MQTT + 1;
+unsigned long bootTimes[bootPhaseCount];
+
+#if defined(HOMIE_DISCOVERY) && HOMIE_DISCOVERY
+// Discovery runs in the background after every MQTT connect, see handleHomieDiscovery()
+enum DiscoveryState { DISCOVERY_DONE, DISCOVERY_PENDING, DISCOVERY_CHECKING, DISCOVERY_PUBLISHING };
+DiscoveryState discoveryState = DISCOVERY_DONE;
+#endif
+
+void toLower(char* output, const char* input) {
+  strcpy(output, input);
+
+  for (char *iter = output; *iter != '\0'; ++iter) {
+    *iter = std::tolower(*iter);
+  }
+}
+
+const uint32_t fnvOffsetBasis = 2166136261u;
+
+// FNV-1a hash of text, pass the previous result to continue a hash
+uint32_t hashString(const char* text, uint32_t hash = fnvOffsetBasis) {
+  for (; *text != '\0'; text++) {
+    hash = (hash ^ (uint8_t) *text) * 16777619u;
+  }
+  return hash;
+}
+
+void blink()
+{
+  digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
+}
+
+void sendRSSI() {
+  #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+    Serial.print(F("WiFi RSSI: "));
+    Serial.println(WiFi.RSSI());
+  #endif
+  mqttClient.publish(rssiPropertyTopic, String(WiFi.RSSI()).c_str(), true);
+}
+
+// Share of elapsed microseconds the task was busy since the last call, in percent
+unsigned int taskLoad(TaskTime &time, unsigned long elapsed) {
+  const unsigned long busy = time.busyMicros;
+  const unsigned long delta = busy - time.reportedMicros;
+  time.reportedMicros = busy;
+  return elapsed ? (unsigned long long) delta * 100 / elapsed : 0;
+}
+
+// The scheduler counters belong to the RF task, they are read without locking
+void sendStats() {
+  StaticJsonDocument<1024> doc;
+  doc["edgeOverruns"] = mySwitch.getEdgeOverruns();
+  doc["droppedCodes"] = mySwitch.getDroppedCodes();
+  doc["droppedCaptures"] = mySwitch.getDroppedCaptures();
+  doc["waveformCacheHits"] = mySwitch.getWaveformCacheHits();
+  doc["waveformCacheMisses"] = mySwitch.getWaveformCacheMisses();
+  doc["queueHighWaterMark"] = scheduler.getHighWaterMark();
+  doc["queueOverflows"] = scheduler.getOverflows();
+  doc["queueCoalesced"] = scheduler.getCoalesced();
+
+  // Per priority class, lowest first
+  JsonArray queueDepth = doc.createNestedArray("queueDepth");
+  JsonArray queueWaitAvg = doc.createNestedArray("queueWaitAvg");
+  JsonArray queueWaitMax = doc.createNestedArray("queueWaitMax");
+  for (unsigned int priority = 0; priority < priorityCount; priority++) {
+    queueDepth.add(scheduler.count(priority));
+    queueWaitAvg.add(scheduler.getAverageWait(priority));
+    queueWaitMax.add(scheduler.getMaxWait(priority));
+  }
+
+  doc["receivedFrames"] = receiveDedup.getFrames();
+  doc["suppressedFrames"] = receiveDedup.getSuppressed();
+  // Percent of received frames not published as repeats of a press
+  doc["suppressionRatio"] = receiveDedup.getFrames() ? (unsigned long long) receiveDedup.getSuppressed() * 100 / receiveDedup.getFrames() : 0;
+  doc["eventsPending"] = pendingEvents.count() + spilledEvents;
+  doc["eventsHighWaterMark"] = pendingEvents.getHighWaterMark();
+  doc["eventsDropped"] = pendingEvents.getDropped() + eventsDroppedSpill + radioEvents.getDropped();
+  doc["eventsSpilled"] = eventsSpilled;
+  doc["eventLatencyAvg"] = eventsPublished ? eventLatencyTotal / eventsPublished : 0;
+  doc["eventLatencyMax"] = eventLatencyMax;
+  // Percent of one core since the last statistics
+  const unsigned long now = micros();
+  doc["rfTaskLoad"] = taskLoad(rfTaskTime, now - taskTimeTimer);
+  doc["networkTaskLoad"] = taskLoad(networkTaskTime, now - taskTimeTimer);
+  taskTimeTimer = now;
+  doc["fastBoot"] = fastBoot;
+  JsonArray bootTime = doc.createNestedArray("bootTimes");
+  for (unsigned int phase = 0; phase < bootPhaseCount; phase++) {
+    bootTime.add(bootTimes[phase]);
+  }
+
+  char buffer[1024];
+  size_t length = serializeJson(doc, buffer);
+
+  #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+    Serial.print(F("Stats: "));
+    Serial.println(buffer);
+  #endif
+  mqttClient.publish(statsPropertyTopic, (const uint8_t*) buffer, length, true);
+}
+
+// Records a failed connect, the next one waits twice as long up to maxReconnectDelay
+void reconnectFailed(Reconnect &reconnect) {
+  reconnect.delay = (reconnect.delay == 0) ? minReconnectDelay : min(2 * reconnect.delay, maxReconnectDelay);
+  reconnect.timer = millis();
+}
+
+bool reconnectDue(const Reconnect &reconnect) {
+  return (unsigned long)(millis() - reconnect.timer) >= reconnect.delay;
+}
+
+// Connects to the broker if needed, at most one attempt per backoff delay. Never waits for Wi-Fi
+bool checkAndConnectMqtt() {
+  if (mqttClient.connected()) {
+    return true;
+  }
+
+  if (strlen(mqtt_server) == 0 || WiFi.status() != WL_CONNECTED || !reconnectDue(mqttReconnect)) {
+    return false;
+  }
+
+  digitalWrite(LED_BUILTIN, HIGH);
+  ticker.attach(1, blink);
+
+  #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+    Serial.println(F("MQTT connecting..."));
+  #endif
+
+  mqttClient.setServer(mqtt_server, String(mqtt_port).toInt());
+  mqttClient.setKeepAlive(60);
+  // connect() blocks until the broker answers, keep that short
+  mqttClient.setSocketTimeout(mqttSocketTimeout);
+
+  if (!mqttClient.connect(hostname, willTopic, 0, true, "lost")) {
+    reconnectFailed(mqttReconnect);
+
+    #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+      int errorCode = mqttClient.state();
+      Serial.print(F("MQTT connect error: "));
+      Serial.print(errorCode);
+      Serial.print(F(" retry in ms: "));
+      Serial.println(mqttReconnect.delay);
+    #endif
+    return false;
+  }
+  mqttReconnect.delay = 0;
+
+  // All settable properties, messageReceived() routes them
+  mqttClient.subscribe(subscribeTopic);
+
+  mqttClient.publish(willTopic, "ready", true);
+  mqttClient.publish(resetPropertyTopic, "false", true);
+  // see handleSettings() and handleProtocols()
+  settingsPending = true;
+  protocolsChanged = true;
+
+  #if defined(HOMIE_DISCOVERY) && HOMIE_DISCOVERY
+    discoveryState = DISCOVERY_PENDING;
+  #endif
+
+  #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+    Serial.println(F("MQTT connected!"));
+  #endif
+
+  sendRSSI();
+
+  ticker.detach();
+  digitalWrite(LED_BUILTIN, LOW);
+  return true;
+}
+
+// Joins the access point of the last boot with its channel and address, which
+// skips the scan and DHCP. Once the address was used for maxStaticAddressTime
+// without DHCP, only the scan is skipped. false without a boot cache or if
+// that fails
+bool connectCachedWifi() {
+  if (!fastBoot) {
+    return false;
+  }
+
+  const bool reuseAddress = bootCache.staticAddressTime < maxStaticAddressTime;
+  WiFi.mode(WIFI_STA);
+  WiFi.setHostname(hostname);
+  if (reuseAddress) {
+    WiFi.config(IPAddress(bootCache.localIP), IPAddress(bootCache.gatewayIP), IPAddress(bootCache.subnetMask), IPAddress(bootCache.dnsIP));
+  } else {
+    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+  }
+  WiFi.begin(wifiManager.getWiFiSSID().c_str(), wifiManager.getWiFiPass().c_str(), bootCache.channel, bootCache.bssid, true);
+
+  const unsigned long start = millis();
+  while (WiFi.status() != WL_CONNECTED) {
+    if ((unsigned long)(millis() - start) >= fastConnectTimeout) {
+      #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+        Serial.println(F("Fast connect failed"));
+      #endif
+      WiFi.disconnect();
+      // Back to DHCP for the normal connect
+      WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+      return false;
+    }
+    delay(10);
+  }
+
+  memcpy(bssid, bootCache.bssid, sizeof(bssid));
+  staticAddress = reuseAddress;
+  staticAddressBase = reuseAddress ? bootCache.staticAddressTime : 0;
+  return true;
+}
+
+bool autoConnectWifi() {
+  digitalWrite(LED_BUILTIN, LOW);
+  ticker.attach(0.5, blink);
+
+  WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE); // Workarround for hostname problem https://github.com/espressif/arduino-esp32/issues/806
+  wifiManager.setHostname(hostname);
+  wifiManager.setFastConnectMode(true);
+  bool success = wifiManager.autoConnect(hostname);
+
+  if (success) {
+    // Store current BSSID and channel for later reconnect
+    memcpy((void *) &bssid[0], (void *) WiFi.BSSID(), 6);
+
+    // Disable default access point
+    WiFi.mode(WIFI_STA);
+
+    #if (defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG)
+      char mac[18] = { 0 };
+      sprintf(mac, "%02X:%02X:%02X:%02X:%02X:%02X", bssid[0], bssid[1], bssid[2], bssid[3], bssid[4], bssid[5]);
+      Serial.print(F("BSSID: "));
+      Serial.println(mac);
+      if (MDNS.begin(hostname)) {
+        Serial.print(F("MDNS responder started: "));
+        Serial.println(hostname);
+      }
+    #endif
+  }
+
+  ticker.detach();
+  digitalWrite(LED_BUILTIN, HIGH);
+
+  return success;
+}
+
+void beginWifi() {
+  WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE); // Workarround for hostname problem https://github.com/espressif/arduino-esp32/issues/806
+  staticAddress = false;
+  WiFi.mode(WIFI_STA); // Disable default access point
+  WiFi.setHostname(hostname);
+  WiFi.begin(wifiManager.getWiFiSSID().c_str(), wifiManager.getWiFiPass().c_str(), 0, bssid, true);
+
+  #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+    char mac[18] = { 0 };
+    sprintf(mac, "%02X:%02X:%02X:%02X:%02X:%02X", bssid[0], bssid[1], bssid[2], bssid[3], bssid[4], bssid[5]);
+    Serial.print(F("Connecting to "));
+    Serial.print(wifiManager.getWiFiSSID());
+    Serial.print(F(" Using password: "));
+    Serial.print(wifiManager.getWiFiPass());
+    Serial.print(F(" BSSID: "));
+    Serial.print(mac);
+    Serial.println(F(" ..."));
+  #endif
+}
+
+// Steps the Wi-Fi reconnect, returns at once in every state
+void checkAndConnectWifi() {
+  const wl_status_t status = WiFi.status();
+
+  switch (wifiState) {
+    case WIFI_STATE_UP:
+      if (status != WL_CONNECTED) {
+        #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+          Serial.println(F("Wi-Fi connection lost"));
+        #endif
+        digitalWrite(LED_BUILTIN, LOW);
+        ticker.attach(0.5, blink);
+
+        wifiReconnect.delay = 0;
+        wifiState = WIFI_STATE_WAITING;
+      }
+      break;
+
+    case WIFI_STATE_WAITING:
+      if (reconnectDue(wifiReconnect)) {
+        beginWifi();
+        wifiReconnect.timer = millis();
+        wifiState = WIFI_STATE_JOINING;
+      }
+      break;
+
+    case WIFI_STATE_JOINING:
+      if (status == WL_CONNECTED) {
+        #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+          Serial.println(F("Connection established!"));
+          Serial.print(F("IP address:\t"));
+          Serial.println(WiFi.localIP());
+        #endif
+
+        if (MDNS.begin(hostname)) {
+          #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+            Serial.print(F("MDNS responder started: "));
+            Serial.println(hostname);
+          #endif
+        }
+
+        ticker.detach();
+        digitalWrite(LED_BUILTIN, HIGH);
+        wifiState = WIFI_STATE_UP;
+        // The next fast boot has to use the new lease, see handleBootCacheAddress()
+        wifiLeaseChanged = true;
+      } else if (status == WL_CONNECT_FAILED || (unsigned long)(millis() - wifiReconnect.timer) >= wifiConnectTimeout) {
+        WiFi.disconnect();
+        reconnectFailed(wifiReconnect);
+        wifiState = WIFI_STATE_WAITING;
+
+        #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+          Serial.print(F("Connect failed, retry in ms: "));
+          Serial.println(wifiReconnect.delay);
+        #endif
+      }
+      break;
+  }
+}
+
+// Mounts SPIFFS on first use, a fast boot does without it
+bool initSPIFFS() {
+  if (spiffsMounted) {
+    return true;
+  }
+
+  #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+    Serial.println(F("mounting FS..."));
+  #endif
+
+  if (!SPIFFS.begin()) {
+    #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+      Serial.println(F("Formatting FS..."));
+    #endif
+    SPIFFS.format();
+
+    if (!SPIFFS.begin()) {
+      return false;
+    }
+  }
+
+  #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+    Serial.println(F("mounted file system"));
+  #endif
+  spiffsMounted = true;
+  return true;
+}
+
+// Publishes a received code, false if MQTT is down. Its age goes first, so a
+// code delivered late after an outage is never taken for a current one
+bool publishReceivedCode(const RCSwitch::ReceivedCode &code) {
+  const unsigned long latency = millis() - code.timestamp;
+  char payload[24];
+  snprintf(payload, sizeof(payload), "%lu", latency);
+  if (!mqttClient.publish(codeAgePropertyTopic, payload)) {
+    return false;
+  }
+  // %llu, codes can be wider than unsigned long (RCSWITCH_MAX_CODE_BITS)
+  snprintf(payload, sizeof(payload), "%llu", (unsigned long long) code.value);
+  if (!mqttClient.publish(codeReceivedPropertyTopic, payload)) {
+    return false;
+  }
+
+  eventsPublished++;
+  eventLatencyTotal += latency;
+  if (latency > eventLatencyMax) {
+    eventLatencyMax = latency;
+  }
+  return true;
+}
+
+#if defined(EVENT_SPILL) && EVENT_SPILL
+// Appends a code to the spill file, false if it is full
+bool spillEvent(const RCSwitch::ReceivedCode &code) {
+  if (!initSPIFFS()) {
+    return false;
+  }
+
+  // The first spill after a flush starts a new file
+  File spillFile = SPIFFS.open(eventSpillFileName, spilledEvents == 0 ? "w" : "a");
+  if (!spillFile) {
+    return false;
+  }
+
+  bool written = false;
+  if (spillFile.size() + sizeof(code) <= maxEventSpillFileSize) {
+    written = spillFile.write((const uint8_t*) &code, sizeof(code)) == sizeof(code);
+  }
+  spillFile.close();
+
+  if (written) {
+    spilledEvents++;
+    eventsSpilled++;
+  }
+  return written;
+}
+
+// Oldest spilled code, false if there is none
+bool readSpilledEvent(RCSwitch::ReceivedCode &code) {
+  if (spilledEvents == 0) {
+    return false;
+  }
+
+  File spillFile = SPIFFS.open(eventSpillFileName, "r");
+  bool read = spillFile && spillFile.seek(spillReadOffset) &&
+              spillFile.read((uint8_t*) &code, sizeof(code)) == sizeof(code);
+  spillFile.close();
+
+  if (!read) {
+    // Unreadable, give up on the rest of the file
+    eventsDroppedSpill += spilledEvents;
+    spilledEvents = 0;
+    spillReadOffset = 0;
+  }
+  return read;
+}
+
+void popSpilledEvent() {
+  spillReadOffset += sizeof(RCSwitch::ReceivedCode);
+  spilledEvents--;
+  if (spilledEvents == 0) {
+    spillReadOffset = 0;
+    SPIFFS.remove(eventSpillFileName);
+  }
+}
+#endif
+
+// Handed every code decoded by the RF task
+void forwardReceivedCode(const RCSwitch::ReceivedCode &code) {
+  radioEvents.push(code);
+}
+
+// Buffers a code from the RF task, it is published by flushEvents()
+void queueReceivedCode(const RCSwitch::ReceivedCode &code) {
+  #if defined(EVENT_SPILL) && EVENT_SPILL
+    // Move the oldest code to SPIFFS instead of dropping it, the file always holds the older codes
+    RCSwitch::ReceivedCode oldest;
+    if (pendingEvents.isFull() && pendingEvents.peek(oldest) && spillEvent(oldest)) {
+      pendingEvents.pop();
+    }
+  #endif
+  pendingEvents.push(code);
+}
+
+// Publishes the oldest pending code, at most one per eventFlushInterval
+void flushEvents() {
+  if (!mqttClient.connected() || (unsigned long)(millis() - eventFlushTimer) < eventFlushInterval) {
+    return;
+  }
+
+  RCSwitch::ReceivedCode code;
+  #if defined(EVENT_SPILL) && EVENT_SPILL
+    if (readSpilledEvent(code)) {
+      if (publishReceivedCode(code)) {
+        popSpilledEvent();
+        eventFlushTimer = millis();
+      }
+      return;
+    }
+  #endif
+
+  if (pendingEvents.peek(code) && publishReceivedCode(code)) {
+    pendingEvents.pop();
+    eventFlushTimer = millis();
+  }
+}
+
+// Writes the batched frames to the capture file or publishes them, never called from an interrupt
+void flushCapture() {
+  if (captureBuffer.frames() == 0) {
+    return;
+  }
+
+  if (captureMode == CAPTURE_MQTT) {
+    // Every message is a complete stream including the header
+    mqttClient.publish(captureDataPropertyTopic, captureBuffer.data(), captureBuffer.size(), false);
+  } else if (captureMode == CAPTURE_FILE && initSPIFFS()) {
+    File captureFile = SPIFFS.open(captureFileName, "a");
+
+    if (captureFile && captureFile.size() + captureBuffer.size() > maxCaptureFileSize) {
+      // Rotate, keeping the previous file
+      captureFile.close();
+      SPIFFS.remove(captureOldFileName);
+      SPIFFS.rename(captureFileName, captureOldFileName);
+      captureFile = SPIFFS.open(captureFileName, "a");
+    }
+
+    if (!captureFile) {
+      #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+        Serial.println(F("failed to open capture file for writing"));
+      #endif
+    } else {
+      if (captureFile.size() == 0) {
+        uint8_t header[PULSECAPTURE_HEADER_SIZE];
+        captureFile.write(header, writePulseCaptureHeader(header));
+      }
+      captureFile.write(captureBuffer.data(), captureBuffer.size());
+      captureFile.close();
+    }
+  }
+
+  #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+    Serial.print(F("captured frames written: "));
+    Serial.println(captureBuffer.frames());
+  #endif
+
+  captureBuffer.begin(captureMode == CAPTURE_MQTT);
+}
+
+// Appends a protocol in the format of receiver/protocols/set, e.g. [350, [1, 31], [1, 3], [3, 1], false, false, 0, 0, 1]
+void addProtocol(JsonArray protocols, const RCSwitch::Protocol &protocol) {
+  JsonArray entry = protocols.createNestedArray();
+  entry.add(protocol.pulseLength);
+  JsonArray syncFactor = entry.createNestedArray();
+  syncFactor.add(protocol.syncFactor.high);
+  syncFactor.add(protocol.syncFactor.low);
+  JsonArray zero = entry.createNestedArray();
+  zero.add(protocol.zero.high);
+  zero.add(protocol.zero.low);
+  JsonArray one = entry.createNestedArray();
+  one.add(protocol.one.high);
+  one.add(protocol.one.low);
+  entry.add(protocol.invertedSignal);
+  entry.add(protocol.sendEndBit);
+  entry.add(protocol.repeatTransmitDelay);
+  entry.add(protocol.firstSyncTiming);
+  entry.add(protocol.firstDataTiming);
+}
+
+// Publishes a learned protocol with the code it was learned from
+void publishLearnedProtocol(const ProtocolLearner::Result &learned) {
+  StaticJsonDocument<JSON_OBJECT_SIZE(5) + JSON_ARRAY_SIZE(9) + 3 * JSON_ARRAY_SIZE(2)> doc;
+  addProtocol(doc.createNestedArray("protocol"), learned.protocol);
+  doc["code"] = learned.code;
+  doc["bitLength"] = learned.bitLength;
+  doc["frames"] = learned.frames;
+  doc["skew"] = learned.skew;
+
+  char buffer[256];
+  size_t length = serializeJson(doc, buffer);
+  mqttClient.publish(learnedPropertyTopic, (const uint8_t*) buffer, length, false);
+}
+
+void setLearning(bool enabled) {
+  learning = enabled;
+  learnTimer = millis();
+  protocolLearner.begin();
+  mySwitch.setCaptureUnknown(enabled || captureMode != CAPTURE_OFF);
+
+  mqttClient.publish(learnPropertyTopic, enabled ? "true" : "false", true);
+}
+
+// Moves undecodable frames from the receiver into the capture buffer and the learner, the network task is the only reader
+void handleCapture() {
+  RCSwitch::CapturedFrame frame;
+  while (mySwitch.readCaptured(frame)) {
+    if (learning && protocolLearner.add(frame)) {
+      publishLearnedProtocol(protocolLearner.getResult());
+      setLearning(false);
+    }
+    if (captureMode == CAPTURE_OFF) {
+      continue;
+    }
+
+    if (captureBuffer.frames() == 0) {
+      captureTimer = millis();
+    }
+
+    if (!captureBuffer.append(frame)) {
+      flushCapture();
+      captureTimer = millis();
+      captureBuffer.append(frame);
+    }
+  }
+
+  if (captureBuffer.frames() > 0 && (unsigned long)(millis() - captureTimer) >= captureFlushTimeout) {
+    flushCapture();
+  }
+  if (learning && (unsigned long)(millis() - learnTimer) >= learnTimeout) {
+    setLearning(false);
+  }
+}
+
+void setCaptureMode(CaptureMode mode) {
+  flushCapture();
+
+  captureMode = mode;
+  mySwitch.setCaptureUnknown(mode != CAPTURE_OFF || learning);
+  captureBuffer.begin(mode == CAPTURE_MQTT);
+
+  mqttClient.publish(capturePropertyTopic, captureModeNames[mode], true);
+}
+
+// Publishes a finished press with its repeats
+void publishPress(const ReceiveDeduplicator::Press &press) {
+  char payload[128];
+  const int length = snprintf(payload, sizeof(payload), "{\"code\":%llu,\"protocol\":%u,\"bitLength\":%u,\"repeats\":%u,\"duration\":%lu}",
+                              (unsigned long long) press.code.value, press.code.protocol, press.code.bitlength, press.repeats, press.duration);
+  mqttClient.publish(pressPropertyTopic, (const uint8_t*) payload, length, false);
+}
+
+void publishDedup() {
+  char payload[64];
+  const int length = snprintf(payload, sizeof(payload), "{\"holdOff\":%lu,\"pressInfo\":%s}", receiveDedup.getHoldOff(), dedupPressInfo ? "true" : "false");
+  mqttClient.publish(dedupPropertyTopic, (const uint8_t*) payload, length, true);
+}
+
+void setDedup(unsigned long holdOff, bool pressInfo) {
+  receiveDedup.setHoldOff(holdOff);
+  receiveDedup.setPressHandler(pressInfo ? publishPress : NULL);
+  dedupPressInfo = pressInfo;
+  publishDedup();
+}
+
+// Publishes the pulse timing the decoder learned for every protocol that received something
+void publishCalibration() {
+  StaticJsonDocument<1024> doc;
+  doc["enabled"] = calibrationEnabled;
+  JsonArray protocols = doc.createNestedArray("protocols");
+  for (unsigned int protocol = 1; protocol <= RCSwitch::getProtocolCount(); protocol++) {
+    RCSwitch::Calibration calibration;
+    if (!mySwitch.getCalibration(protocol, calibration) || calibration.frames == 0) {
+      continue;
+    }
+    JsonObject entry = protocols.createNestedObject();
+    entry["protocol"] = protocol;
+    entry["pulseLength"] = calibration.pulseLength;
+    entry["highOffset"] = calibration.highOffset;
+    entry["lowOffset"] = calibration.lowOffset;
+    entry["jitter"] = calibration.jitter;
+    entry["frames"] = calibration.frames;
+  }
+
+  char buffer[1024];
+  size_t length = serializeJson(doc, buffer);
+  mqttClient.publish(calibrationPropertyTopic, (const uint8_t*) buffer, length, true);
+}
+
+void setCalibration(bool enabled, bool reset) {
+  if (reset) {
+    mySwitch.resetCalibration();
+  }
+  mySwitch.setCalibration(enabled);
+  calibrationEnabled = enabled;
+  publishCalibration();
+}
+
+// Publishes the retained receiver settings after a connect
+void handleSettings() {
+  if (!settingsPending || !mqttClient.connected()) {
+    return;
+  }
+  settingsPending = false;
+
+  mqttClient.publish(capturePropertyTopic, captureModeNames[captureMode], true);
+  publishDedup();
+  publishCalibration();
+  mqttClient.publish(learnPropertyTopic, learning ? "true" : "false", true);
+}
+
+// Reads a pulse pair like [1, 31], false if it does not fit into a HighLow
+bool readHighLow(JsonVariant json, RCSwitch::HighLow &highLow) {
+  const unsigned int high = json[0] | 256u;
+  const unsigned int low = json[1] | 256u;
+  if (json.size() != 2 || high > 255 || low > 255) {
+    return false;
+  }
+  highLow.high = high;
+  highLow.low = low;
+  return true;
+}
+
+// Reads a protocol table with the fields of RCSwitch::Protocol in their order, e.g.
+// [[350, [1, 31], [1, 3], [3, 1], false, false, 0, 0, 1]]. -1 if a protocol is invalid
+int readProtocols(JsonArray json, RCSwitch::Protocol* protocols) {
+  if (json.size() > RCSWITCH_MAX_PROTOCOLS) {
+    return -1;
+  }
+
+  int count = 0;
+  for (JsonVariant entry : json) {
+    RCSwitch::Protocol &protocol = protocols[count];
+    const unsigned long pulseLength = entry[0] | 0ul;
+    const unsigned long repeatTransmitDelay = entry[6] | 0ul;
+    if (entry.size() != 9 || pulseLength > 0xFFFF || repeatTransmitDelay > RCSWITCH_MAX_REPEAT_DELAY ||
+        !readHighLow(entry[1], protocol.syncFactor) ||
+        !readHighLow(entry[2], protocol.zero) ||
+        !readHighLow(entry[3], protocol.one)) {
+      return -1;
+    }
+    protocol.pulseLength = pulseLength;
+    protocol.invertedSignal = entry[4] | false;
+    protocol.sendEndBit = entry[5] | false;
+    protocol.repeatTransmitDelay = repeatTransmitDelay;
+    protocol.firstSyncTiming = entry[7] | 0u;
+    protocol.firstDataTiming = entry[8] | 0u;
+    if (!RCSwitch::isValidProtocol(protocol)) {
+      return -1;
+    }
+    count++;
+  }
+  return count;
+}
+
+// Whether two protocols send and receive the same waveforms
+bool sameProtocol(const RCSwitch::Protocol &a, const RCSwitch::Protocol &b) {
+  return a.pulseLength == b.pulseLength &&
+         a.syncFactor.high == b.syncFactor.high && a.syncFactor.low == b.syncFactor.low &&
+         a.zero.high == b.zero.high && a.zero.low == b.zero.low &&
+         a.one.high == b.one.high && a.one.low == b.one.low &&
+         a.invertedSignal == b.invertedSignal && a.sendEndBit == b.sendEndBit &&
+         a.repeatTransmitDelay == b.repeatTransmitDelay &&
+         a.firstSyncTiming == b.firstSyncTiming && a.firstDataTiming == b.firstDataTiming;
+}
+
+// Looks up the Type A protocol in a table read by readProtocols() and appends it if it is missing,
+// so sendtypea keeps its timing whatever table is loaded. -1 if there is no room left for it
+int addTypeAProtocol(RCSwitch::Protocol* protocols, int count, unsigned int &typeA) {
+  RCSwitch::Protocol protocol;
+  RCSwitch::getBuiltInProtocol(typeABuiltInProtocol, protocol);
+
+  if (count == 0) {
+    // the built-in protocols are restored
+    typeA = typeABuiltInProtocol;
+    return 0;
+  }
+  for (int i = 0; i < count; i++) {
+    if (sameProtocol(protocols[i], protocol)) {
+      typeA = i + 1;
+      return count;
+    }
+  }
+  if (count == RCSWITCH_MAX_PROTOCOLS) {
+    return -1;
+  }
+  protocols[count] = protocol;
+  typeA = count + 1;
+  return count + 1;
+}
+
+// Publishes the protocol table in use, in the format of receiver/protocols/set
+void publishProtocols() {
+  DynamicJsonDocument doc(protocolsDocSize);
+  JsonArray protocols = doc.to<JsonArray>();
+  RCSwitch::Protocol protocol;
+  for (unsigned int i = 1; RCSwitch::getProtocol(i, protocol); i++) {
+    addProtocol(protocols, protocol);
+  }
+
+  char buffer[mqttBufferSize];
+  size_t length = serializeJson(doc, buffer);
+  mqttClient.publish(protocolsPropertyTopic, (const uint8_t*) buffer, length, true);
+}
+
+// Loads the protocol table saved by protocolsReceived(), false if there is none
+bool readProtocolsFile() {
+  if (!initSPIFFS() || !SPIFFS.exists(protocolsFileName)) {
+    return false;
+  }
+  File protocolsFile = SPIFFS.open(protocolsFileName, "r");
+  if (!protocolsFile) {
+    return false;
+  }
+
+  DynamicJsonDocument doc(protocolsDocSize + protocolsFile.size());
+  DeserializationError error = deserializeJson(doc, protocolsFile);
+  protocolsFile.close();
+
+  RCSwitch::Protocol protocols[RCSWITCH_MAX_PROTOCOLS];
+  unsigned int typeA = typeABuiltInProtocol;
+  int count = !error && doc.is<JsonArray>() ? readProtocols(doc.as<JsonArray>(), protocols) : -1;
+  if (count > 0) {
+    count = addTypeAProtocol(protocols, count, typeA);
+  }
+  if (count <= 0 || !RCSwitch::loadProtocols(protocols, count)) {
+    #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+      Serial.println(F("invalid protocols file"));
+    #endif
+    return false;
+  }
+  loadedTypeAProtocol = typeA;
+  return true;
+}
+
+// Optional "priority" of a send command, "low", "normal", "high" or 0-2
+int readPriority(JsonObject json) {
+  JsonVariant priority = json["priority"];
+
+  if (priority.is<const char*>()) {
+    if (priority == "low") return PRIORITY_LOW;
+    if (priority == "high") return PRIORITY_HIGH;
+  } else if (priority.is<int>()) {
+    return priority.as<int>();
+  }
+  return PRIORITY_NORMAL;
+}
+
+// Reads a command of a batch, a sendtypea command if it has a group and device, a send command otherwise.
+// false if values are missing or invalid
+bool readSendCommand(JsonObject json, CodeQueueItem &item) {
+  if (json.containsKey("group") && json.containsKey("device") && json.containsKey("repeatTransmit")) {
+    String group = json["group"];
+    String device = json["device"];
+    bool switchOnOff = json["switchOnOff"];
+
+    char* sCodeWord = mySwitch.getCodeWordA(group.c_str(), device.c_str(), switchOnOff);
+    RCSwitch::CodeValue code = 0;
+    unsigned int codeLength = 0;
+    mySwitch.triStateGetCodeAndLength(sCodeWord, code, codeLength);
+
+    initQueueItem(item, code, codeLength, typeAProtocol, json["repeatTransmit"], readPriority(json), typeAStateMask);
+    return true;
+  }
+
+  if (json.containsKey("code") && json.containsKey("codeLength") && json.containsKey("protocol") && json.containsKey("repeatTransmit")) {
+    if (!isValidSendCommand(json["codeLength"], json["protocol"])) {
+      return false;
+    }
+    initQueueItem(item, json["code"], json["codeLength"], json["protocol"], json["repeatTransmit"], readPriority(json));
+    return true;
+  }
+
+  return false;
+}
+
+// Hands send commands to the RF task, all of them or, if they might not fit
+// into radioCommands or their send queues, none. The commands still on their
+// way to the RF task count against the room it reported.
+bool submitCodes(const CodeQueueItem* items, unsigned int count) {
+  unsigned int needed[priorityCount] = { 0 };
+  for (unsigned int i = 0; i < count; i++) {
+    needed[items[i].priority]++;
+  }
+
+  // The RF task reports the room before the commands it accounts for, so
+  // reading them in the opposite order never overestimates it
+  unsigned long taken[priorityCount];
+  for (unsigned int priority = 0; priority < priorityCount; priority++) {
+    taken[priority] = radioTakenCodes[priority];
+  }
+  SPSCQUEUE_MEMORY_BARRIER();
+
+  bool fits = count <= radioCommands.space();
+  for (unsigned int priority = 0; priority < priorityCount; priority++) {
+    const unsigned long pending = submittedCodes[priority] - taken[priority];
+    if (needed[priority] + pending > radioQueueRoom[priority]) {
+      fits = false;
+    }
+  }
+  if (!fits) {
+    #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+      Serial.println(F("Error: Send queue is full!"));
+    #endif
+    return false;
+  }
+
+  for (unsigned int i = 0; i < count; i++) {
+    radioCommands.push(items[i]);
+    submittedCodes[items[i].priority]++;
+  }
+  return true;
+}
+
+bool submitCode(RCSwitch::CodeValue code, unsigned int length, int protocol, int repeatTransmit, int priority = PRIORITY_NORMAL, RCSwitch::CodeValue stateMask = 0) {
+  CodeQueueItem item;
+  initQueueItem(item, code, length, protocol, repeatTransmit, priority, stateMask);
+  return submitCodes(&item, 1);
+}
+
+// Publishes the send queue length whenever the RF task reports a new one
+void publishQueueLength() {
+  const unsigned int queueCount = radioQueueLength;
+  if (queueCount == publishedQueueLength || !mqttClient.publish(queueLengthPropertyTopic, String(queueCount).c_str(), true)) {
+    return;
+  }
+  publishedQueueLength = queueCount;
+
+  #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+    Serial.print(F("Queue count: "));
+    Serial.println(queueCount);
+  #endif
+}
+
+void sendBatchReceived(const byte* payload, unsigned int length) {
+  //example request: [{"code": 1234, "codeLength": 24, "protocol": 1, "repeatTransmit": 5}, {"group": "11111", "device": "11111", "repeatTransmit": 5, "switchOnOff": true}]
+
+  DynamicJsonDocument doc(JSON_ARRAY_SIZE(maxQueueCount) + maxQueueCount * JSON_OBJECT_SIZE(6) + length);
+  DeserializationError error = deserializeJson(doc, payload, length);
+
+  if (error || !doc.is<JsonArray>()) {
+    #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+      Serial.print(F("sendbatch is no json array: "));
+      Serial.println(error.c_str());
+    #endif
+    return;
+  }
+
+  JsonArray commands = doc.as<JsonArray>();
+  if (commands.size() == 0 || commands.size() > maxQueueCount) {
+    #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+      Serial.println(F("sendbatch size out of range!"));
+    #endif
+    return;
+  }
 
-String rssiPropertyTopic;
-String logPropertyTopic;
-String resetPropertyTopic;
-String resetSetPropertyTopic;
+  CodeQueueItem items[maxQueueCount];
+  unsigned int count = 0;
+  for (JsonObject command : commands) {
+    if (!readSendCommand(command, items[count])) {
+      #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+        Serial.println(F("Values missing or invalid!"));
+      #endif
+      return;
+    }
+    count++;
+  }
+
+  if (!submitCodes(items, count)) {
+    return;
+  }
+
+  // One confirmation for the whole batch
+  mqttClient.publish(sendBatchPropertyTopic, payload, length, true);
+
+  #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+    Serial.print(F("sendbatch added to queue, commands: "));
+    Serial.println(count);
+  #endif
+}
+
+void sendBinReceived(const byte* payload, unsigned int length) {
+  // Fixed size records, no parsing beyond a length check
+  CodeQueueItem items[maxQueueCount];
+  unsigned int count = readBinaryCommands(payload, length, items, maxQueueCount);
+
+  if (count == 0) {
+    #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+      Serial.print(F("invalid sendbin payload, length: "));
+      Serial.println(length);
+    #endif
+    return;
+  }
+
+  if (!submitCodes(items, count)) {
+    return;
+  }
+
+  // Confirmed with the number of records as text, the property is a string
+  mqttClient.publish(sendBinPropertyTopic, String(count).c_str(), true);
+
+  #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+    Serial.print(F("sendbin added to queue, commands: "));
+    Serial.println(count);
+  #endif
+}
+
+/* helper function for the message handlers, true if the payload is exactly text */
+static bool payloadEquals(const byte* payload, unsigned int length, const char* text) {
+  return strlen(text) == length && memcmp(payload, text, length) == 0;
+}
+
+// Parses a JSON command, false if it is invalid
+bool readJsonCommand(const byte* payload, unsigned int length, JsonDocument &doc) {
+  DeserializationError error = deserializeJson(doc, payload, length);
+
+  #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+    Serial.print(F("json: "));
+    serializeJson(doc, Serial);
+    Serial.println();
+  #endif
+
+  if (error) {
+    #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+      Serial.print(F("deserializeJson() failed: "));
+      Serial.println(error.c_str());
+    #endif
+    return false;
+  }
+  return true;
+}
+
+void resetReceived(const byte* payload, unsigned int length) {
+  if (payloadEquals(payload, length, "true")) {
+    drd->stop();
+    ESP.restart();
+  }
+}
+
+void captureReceived(const byte* payload, unsigned int length) {
+  for (int mode = CAPTURE_OFF; mode <= CAPTURE_MQTT; mode++) {
+    if (payloadEquals(payload, length, captureModeNames[mode])) {
+      setCaptureMode((CaptureMode) mode);
+    }
+  }
+}
+
+void dedupReceived(const byte* payload, unsigned int length) {
+  //example request: {"holdOff": 300, "pressInfo": true}
+
+  StaticJsonDocument<64> doc;
+  if (!readJsonCommand(payload, length, doc)) {
+    return;
+  }
+
+  setDedup(doc["holdOff"] | defaultHoldOff, doc["pressInfo"] | false);
+}
+
+void calibrationReceived(const byte* payload, unsigned int length) {
+  //example request: {"enabled": true, "reset": true}
+
+  StaticJsonDocument<64> doc;
+  if (!readJsonCommand(payload, length, doc)) {
+    return;
+  }
+
+  setCalibration(doc["enabled"] | true, doc["reset"] | false);
+}
+
+void protocolsReceived(const byte* payload, unsigned int length) {
+  //example request: [[350, [1, 31], [1, 3], [3, 1], false, false, 0, 0, 1]], [] restores the built-in protocols
+
+  DynamicJsonDocument doc(protocolsDocSize + length);
+  if (!readJsonCommand(payload, length, doc) || !doc.is<JsonArray>()) {
+    return;
+  }
+
+  RCSwitch::Protocol protocols[RCSWITCH_MAX_PROTOCOLS];
+  unsigned int typeA = typeABuiltInProtocol;
+  int count = readProtocols(doc.as<JsonArray>(), protocols);
+  if (count >= 0) {
+    count = addTypeAProtocol(protocols, count, typeA);
+  }
+  if (count < 0 || !RCSwitch::loadProtocols(protocols, count)) {
+    #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+      Serial.println(F("protocols rejected"));
+    #endif
+    return;
+  }
+  loadedTypeAProtocol = typeA;
+
+  customProtocols = count > 0;
+  if (initSPIFFS()) {
+    if (customProtocols) {
+      File protocolsFile = SPIFFS.open(protocolsFileName, "w");
+      if (protocolsFile) {
+        protocolsFile.write(payload, length);
+        protocolsFile.close();
+      }
+    } else {
+      SPIFFS.remove(protocolsFileName);
+    }
+  }
+  protocolsChanged = true;
+}
+
+void learnReceived(const byte* payload, unsigned int length) {
+  if (payloadEquals(payload, length, "true")) {
+    setLearning(true);
+  } else if (payloadEquals(payload, length, "false")) {
+    setLearning(false);
+  }
+}
+
+void sendTypeAReceived(const byte* payload, unsigned int length) {
+  //example request: {"group": "11111", "device": "11111", "repeatTransmit": 5, "switchOnOff": true}
+
+  StaticJsonDocument<255> doc;
+  if (!readJsonCommand(payload, length, doc)) {
+    return;
+  }
+  JsonObject json = doc.as<JsonObject>();
+
+  if (!json.containsKey("group") || !json.containsKey("device") || !json.containsKey("repeatTransmit") || !json.containsKey("repeatTransmit")) {
+    #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+      Serial.println(F("Values missing!"));
+    #endif
+    return;
+  }
+  
+  String group = json["group"];
+  String device = json["device"];
+  int repeatTransmit = json["repeatTransmit"];
+  bool switchOnOff = json["switchOnOff"];
+
+  char* sCodeWord = mySwitch.getCodeWordA(group.c_str(), device.c_str(), switchOnOff);
+  RCSwitch::CodeValue code = 0;
+  unsigned int codeLength = 0;
+  mySwitch.triStateGetCodeAndLength(sCodeWord, code, codeLength);
+
+  if (!submitCode(code, codeLength, typeAProtocol, repeatTransmit, readPriority(json), typeAStateMask)) {
+    return;
+  }
+
+  // Send message to main topic to confirm message received
+  mqttClient.publish(sendTypeAPropertyTopic, payload, length, true);
+
+  #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+    Serial.print(F("sendtypea added to queue, group: "));
+    Serial.print(group);
+    Serial.print(F(" device: "));
+    Serial.print(device);
+    Serial.print(F(" repeatTransmit: "));
+    Serial.print(repeatTransmit);
+    Serial.print(F(" switch: "));
+    Serial.println(switchOnOff);
+  #endif
+}
+
+void sendReceived(const byte* payload, unsigned int length) {
+  //example request: {"code": 1234, "codeLength": 24, "protocol": 1, "repeatTransmit": 5 }
+
+  StaticJsonDocument<255> doc;
+  if (!readJsonCommand(payload, length, doc)) {
+    return;
+  }
+  JsonObject json = doc.as<JsonObject>();
+
+  if (!json.containsKey("code") || !json.containsKey("codeLength") || !json.containsKey("protocol") || !json.containsKey("repeatTransmit")) {
+    #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+      Serial.println(F("Values missing!"));
+    #endif
+    return;
+  }
+  
+  RCSwitch::CodeValue code = json["code"];
+  int codeLength = json["codeLength"];
+  int protocol = json["protocol"];
+  int repeatTransmit = json["repeatTransmit"];
+
+  // Longer codes would be cut to their low bits
+  if (codeLength < 0 || !isValidSendCommand(codeLength, protocol)) {
+    #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+      Serial.println(F("Invalid codeLength or protocol!"));
+    #endif
+    return;
+  }
+
+  if (!submitCode(code, codeLength, protocol, repeatTransmit, readPriority(json))) {
+    return;
+  }
 
-String sendTypeAPropertyTopic;
-String sendTypeASetPropertyTopic;
-String sendPropertyTopic;
-String sendSetPropertyTopic;
+  // Send message to main topic to confirm message received
+  mqttClient.publish(sendPropertyTopic, payload, length, true);
 
-String queueLengthPropertyTopic;
-String codeReceivedPropertyTopic;
+  #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+    Serial.print(F("send added to queue, code: "));
+    Serial.print(code);
+    Serial.print(F(" codeLength: "));
+    Serial.print(codeLength);
+    Serial.print(F(" protocol: "));
+    Serial.print(protocol);
+    Serial.print(F(" repeatTransmit: "));
+    Serial.println(repeatTransmit);
+  #endif
+}
 
-class CodeQueueItem
-{
-  public:
-    unsigned long code;
-    unsigned int length;
-    int protocol;
-    int repeatTransmit;
-    virtual void f() { }
+#if defined(HOMIE_DISCOVERY) && HOMIE_DISCOVERY
+struct HomieAttribute {
+  // Topic below the device topic, empty for the device itself
+  const char* path;
+  const char* attribute;
+  // nullptr for the hostname
+  const char* value;
 };
 
-const unsigned int maxQueueCount = 30;
-QueueList <CodeQueueItem> queue;
+// Retained discovery attributes, published in this order
+const HomieAttribute homieAttributes[] = {
+  { "system/rssi", "$name", "Wifi RSSI" },
+  { "system/rssi", "$unit", "dB" },
+  { "system/rssi", "$datatype", "integer" },
+  { "system/rssi", "$format", "-100:0" },
 
-unsigned long rssiTimer = 0;
-const unsigned long rssiTimeout = 60000;
+  { "system/stats", "$name", "Statistics" },
+  { "system/stats", "$datatype", "string" },
 
-void toLower(char* output, const char* input) {
-  strcpy(output, input);
+  { "system/log", "$name", "Debug log" },
+  { "system/log", "$datatype", "string" },
+  { "system/log", "$retained", "false" },
 
-  for (char *iter = output; *iter != '\0'; ++iter) {
-    *iter = std::tolower(*iter);
-  }
-}
+  { "system/reset", "$name", "Reset controller" },
+  { "system/reset", "$datatype", "boolean" },
+  { "system/reset", "$settable", "true" },
 
-void blink()
-{
-  digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
-}
+  { "system", "$name", "System" },
+  { "system", "$properties", "rssi,stats,log,reset" },
 
-void sendRSSI() {
-  #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-    Serial.print(F("WiFi RSSI: "));
-    Serial.println(WiFi.RSSI());
-  #endif
-  mqttClient.publish(rssiPropertyTopic.c_str(), String(WiFi.RSSI()).c_str(), true);
-}
+  { "sender/sendtypea", "$name", "Send type a signal" },
+  { "sender/sendtypea", "$datatype", "string" },
+  { "sender/sendtypea", "$settable", "true" },
 
-bool checkAndConnectMqtt() {
-  if (!mqttClient.connected()) {
-    digitalWrite(LED_BUILTIN, HIGH);
-    ticker.attach(1, blink);
-        
-    if (strlen(mqtt_server) != 0) {
-      #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-        Serial.println(F("MQTT connecting..."));
-      #endif
+  { "sender/send", "$name", "Send signal" },
+  { "sender/send", "$datatype", "string" },
+  { "sender/send", "$settable", "true" },
 
-      mqttClient.setServer(mqtt_server, String(mqtt_port).toInt());
-      mqttClient.setKeepAlive(60);
+  { "sender/sendbatch", "$name", "Send several signals" },
+  { "sender/sendbatch", "$datatype", "string" },
+  { "sender/sendbatch", "$settable", "true" },
 
-      while (!mqttClient.connect(hostname, willTopic.c_str(), 0, true, "lost")) {
-        #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-          int errorCode = mqttClient.state();
-          Serial.print(F("MQTT connect error: "));
-          Serial.println(errorCode);
-        #endif
+  { "sender/sendbin", "$name", "Send binary signals" },
+  { "sender/sendbin", "$datatype", "string" },
+  { "sender/sendbin", "$settable", "true" },
 
-        ticker.detach();
-        return false;
-      }
+  { "sender", "$name", "Sender" },
+  { "sender", "$properties", "sendtypea,send,sendbatch,sendbin" },
 
-      mqttClient.subscribe(sendTypeASetPropertyTopic.c_str());
-      mqttClient.subscribe(sendSetPropertyTopic.c_str());
-      mqttClient.subscribe(resetSetPropertyTopic.c_str());
+  { "receiver/queuelength", "$name", "Sender queue length" },
+  { "receiver/queuelength", "$datatype", "integer" },
 
-      mqttClient.publish(willTopic.c_str(), "ready", true);
-      mqttClient.publish(resetPropertyTopic.c_str(), "false", true);
+  { "receiver/codereceived", "$name", "Code received event" },
+  { "receiver/codereceived", "$datatype", "integer" },
+  { "receiver/codereceived", "$retained", "false" },
 
-      #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-        Serial.println(F("MQTT connected!"));
-      #endif
+  { "receiver/codeage", "$name", "Age of the received code" },
+  { "receiver/codeage", "$datatype", "integer" },
+  { "receiver/codeage", "$unit", "ms" },
+  { "receiver/codeage", "$retained", "false" },
 
-      sendRSSI();
+  { "receiver/capture", "$name", "Capture unknown frames" },
+  { "receiver/capture", "$datatype", "enum" },
+  { "receiver/capture", "$format", "off,file,mqtt" },
+  { "receiver/capture", "$settable", "true" },
 
-      ticker.detach();
-      digitalWrite(LED_BUILTIN, LOW);
-    }
-  }
+  { "receiver/capturedata", "$name", "Captured frames" },
+  { "receiver/capturedata", "$datatype", "string" },
+  { "receiver/capturedata", "$retained", "false" },
 
-  return true;
-}
+  { "receiver", "$name", "Receiver" },
+  { "receiver/dedup", "$name", "Receive deduplication" },
+  { "receiver/dedup", "$datatype", "string" },
+  { "receiver/dedup", "$settable", "true" },
 
-bool autoConnectWifi() {
-  digitalWrite(LED_BUILTIN, LOW);
-  ticker.attach(0.5, blink);
+  { "receiver/press", "$name", "Button press" },
+  { "receiver/press", "$datatype", "string" },
+  { "receiver/press", "$retained", "false" },
 
-  WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE); // Workarround for hostname problem https://github.com/espressif/arduino-esp32/issues/806
-  wifiManager.setHostname(hostname);
-  wifiManager.setFastConnectMode(true);
-  bool success = wifiManager.autoConnect(hostname);
+  { "receiver/calibration", "$name", "Learned pulse timing" },
+  { "receiver/calibration", "$datatype", "string" },
+  { "receiver/calibration", "$settable", "true" },
 
-  if (success) {
-    // Store current BSSID and channel for later reconnect
-    memcpy((void *) &bssid[0], (void *) WiFi.BSSID(), 6);
+  { "receiver/protocols", "$name", "Protocol table" },
+  { "receiver/protocols", "$datatype", "string" },
+  { "receiver/protocols", "$settable", "true" },
 
-    // Disable default access point
-    WiFi.mode(WIFI_STA);
+  { "receiver/learn", "$name", "Learn protocol of unknown frames" },
+  { "receiver/learn", "$datatype", "boolean" },
+  { "receiver/learn", "$settable", "true" },
 
-    #if (defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG)
-      char mac[18] = { 0 };
-      sprintf(mac, "%02X:%02X:%02X:%02X:%02X:%02X", bssid[0], bssid[1], bssid[2], bssid[3], bssid[4], bssid[5]);
-      Serial.print(F("BSSID: "));
-      Serial.println(mac);
-      if (MDNS.begin(hostname)) {
-        Serial.print(F("MDNS responder started: "));
-        Serial.println(hostname);
-      }
-    #endif
-  }
+  { "receiver/learned", "$name", "Learned protocol" },
+  { "receiver/learned", "$datatype", "string" },
+  { "receiver/learned", "$retained", "false" },
 
-  ticker.detach();
-  digitalWrite(LED_BUILTIN, HIGH);
+  { "receiver", "$properties", "queuelength,codereceived,codeage,capture,capturedata,dedup,press,calibration,protocols,learn,learned" },
 
-  return success;
+  { "", "$homie", "4.0" },
+  { "", "$name", nullptr },
+  { "", "$nodes", "system,sender,receiver" },
+  { "", "$implementation", "ESP32" },
+  { "", "$extensions", "" },
+};
+const size_t homieAttributeCount = sizeof(homieAttributes) / sizeof(homieAttributes[0]);
+
+// Attributes published per loop(), receiving and sending keep running in between
+const size_t discoveryBurst = 8;
+// Time to wait for the retained fingerprint before everything is published
+const unsigned long fingerprintTimeout = 1000;
+
+size_t discoveryPosition = 0;
+unsigned long discoveryTimer = 0;
+// Topic of the attribute being published, reused for all of them
+char discoveryTopic[maxTopicLength + 32];
+// Hash over all attributes as 8 hex digits
+char discoveryFingerprint[9];
+
+const char* attributeValue(const HomieAttribute &attribute) {
+  return attribute.value != nullptr ? attribute.value : hostname;
 }
 
-void checkAndConnectWifi() {
-  if (WiFi.status() != WL_CONNECTED) {
-    digitalWrite(LED_BUILTIN, LOW);
-    ticker.attach(0.5, blink);
-    
-    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE); // Workarround for hostname problem https://github.com/espressif/arduino-esp32/issues/806
-    WiFi.mode(WIFI_STA); // Disable default access point
-    WiFi.setHostname(hostname);
-    WiFi.begin(wifiManager.getWiFiSSID().c_str(), wifiManager.getWiFiPass().c_str(), 0, bssid, true);
+void buildDiscoveryFingerprint() {
+  uint32_t hash = fnvOffsetBasis;
+  for (size_t i = 0; i < homieAttributeCount; i++) {
+    hash = hashString(homieAttributes[i].path, hash);
+    hash = hashString("/", hash);
+    hash = hashString(homieAttributes[i].attribute, hash);
+    hash = hashString("=", hash);
+    hash = hashString(attributeValue(homieAttributes[i]), hash);
+    hash = hashString("\n", hash);
+  }
+  snprintf(discoveryFingerprint, sizeof(discoveryFingerprint), "%08lx", (unsigned long) hash);
+}
+
+// The broker sends the retained fingerprint of the last complete discovery right after subscribing
+void fingerprintReceived(const byte* payload, unsigned int length) {
+  if (discoveryState != DISCOVERY_CHECKING) {
+    return;
+  }
 
+  if (payloadEquals(payload, length, discoveryFingerprint)) {
     #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-      char mac[18] = { 0 };
-      sprintf(mac, "%02X:%02X:%02X:%02X:%02X:%02X", bssid[0], bssid[1], bssid[2], bssid[3], bssid[4], bssid[5]);
-      Serial.print(F("Connecting to "));
-      Serial.print(wifiManager.getWiFiSSID());
-      Serial.print(F(" Using password: "));
-      Serial.print(wifiManager.getWiFiPass());
-      Serial.print(F(" BSSID: "));
-      Serial.print(mac);
-      Serial.println(F(" ..."));
+      Serial.println(F("Homie discovery unchanged"));
     #endif
+    mqttClient.unsubscribe(fingerprintTopic);
+    discoveryState = DISCOVERY_DONE;
+  } else {
+    discoveryPosition = 0;
+    discoveryState = DISCOVERY_PUBLISHING;
+  }
+}
 
-    int i = 0;
-    while (WiFi.status() != WL_CONNECTED) { // Wait for the Wi-Fi to connect
-      delay(1000);
-      #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-        Serial.print(++i);
-        Serial.print(F(" "));
-      #endif
+// Publishes the next count attributes back to back, QoS 0 never waits for the broker
+void publishHomieAttributes(size_t count) {
+  char* suffix = discoveryTopic + deviceTopicLength;
+  const size_t suffixSize = sizeof(discoveryTopic) - deviceTopicLength;
+
+  for (; count > 0 && discoveryPosition < homieAttributeCount; count--, discoveryPosition++) {
+    const HomieAttribute &attribute = homieAttributes[discoveryPosition];
+    if (attribute.path[0] != '\0') {
+      snprintf(suffix, suffixSize, "/%s/%s", attribute.path, attribute.attribute);
+    } else {
+      snprintf(suffix, suffixSize, "/%s", attribute.attribute);
+    }
+    mqttClient.publish(discoveryTopic, attributeValue(attribute), true);
+  }
+}
+
+void handleHomieDiscovery() {
+  switch (discoveryState) {
+    case DISCOVERY_PENDING:
+      buildDiscoveryFingerprint();
+      memcpy(discoveryTopic, deviceTopic, deviceTopicLength);
+      mqttClient.subscribe(fingerprintTopic);
+      discoveryTimer = millis();
+      discoveryState = DISCOVERY_CHECKING;
+      break;
+
+    case DISCOVERY_CHECKING:
+      // No fingerprint retained, e.g. first boot or a new broker
+      if ((unsigned long)(millis() - discoveryTimer) >= fingerprintTimeout) {
+        discoveryPosition = 0;
+        discoveryState = DISCOVERY_PUBLISHING;
+      }
+      break;
+
+    case DISCOVERY_PUBLISHING:
+      publishHomieAttributes(discoveryBurst);
+      if (discoveryPosition == homieAttributeCount) {
+        // The fingerprint goes last, an interrupted discovery is repeated on the next connect
+        mqttClient.unsubscribe(fingerprintTopic);
+        mqttClient.publish(fingerprintTopic, discoveryFingerprint, true);
+        mqttClient.publish(willTopic, "ready", true);
+        discoveryState = DISCOVERY_DONE;
 
-      if (WiFi.status() == WL_CONNECT_FAILED) {
-        #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-          Serial.println();
-          Serial.println(F("Connect failed"));
-        #endif
-        delay(5000);
-        WiFi.begin(wifiManager.getWiFiSSID().c_str(), wifiManager.getWiFiPass().c_str(), 0, bssid, true);
         #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-          Serial.print(F("."));
+          Serial.print(F("Homie discovery published: "));
+          Serial.println(discoveryFingerprint);
         #endif
       }
-    }
+      break;
 
-    #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-      Serial.println(F("\n"));
-      Serial.println(F("Connection established!"));  
-      Serial.print(F("IP address:\t"));
-      Serial.println(WiFi.localIP());
-    #endif
+    case DISCOVERY_DONE:
+      break;
+  }
+}
+#endif
 
-    if (MDNS.begin(hostname)) {
-      #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-        Serial.print(F("MDNS responder started: "));
-        Serial.println(hostname);
-      #endif
-    }
+typedef void (*MessageHandler)(const byte* payload, unsigned int length);
+
+struct MessageRoute {
+  // Topic below the device topic, e.g. "sender/send/set"
+  const char* property;
+  MessageHandler handler;
+};
+
+// Settable properties, a new one only needs an entry here
+const MessageRoute messageRoutes[] = {
+  { "system/reset/set", resetReceived },
+  { "sender/sendtypea/set", sendTypeAReceived },
+  { "sender/send/set", sendReceived },
+  { "sender/sendbatch/set", sendBatchReceived },
+  { "sender/sendbin/set", sendBinReceived },
+  { "receiver/capture/set", captureReceived },
+  { "receiver/dedup/set", dedupReceived },
+  { "receiver/calibration/set", calibrationReceived },
+  { "receiver/protocols/set", protocolsReceived },
+  { "receiver/learn/set", learnReceived },
+  #if defined(HOMIE_DISCOVERY) && HOMIE_DISCOVERY
+    { "$fingerprint", fingerprintReceived },
+  #endif
+};
+const size_t messageRouteCount = sizeof(messageRoutes) / sizeof(messageRoutes[0]);
+uint32_t messageRouteHashes[messageRouteCount];
 
-    ticker.detach();
-    digitalWrite(LED_BUILTIN, HIGH);
+void initMessageRoutes() {
+  for (size_t i = 0; i < messageRouteCount; i++) {
+    messageRouteHashes[i] = hashString(messageRoutes[i].property);
   }
 }
 
 void messageReceived(char* topic, const byte* payload, unsigned int length) {
-  String topicString = topic;
-
   #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
     Serial.print(F("incoming message: "));
-    Serial.println(topicString);
+    Serial.println(topic);
   #endif
 
-  if (topicString == resetSetPropertyTopic) {
-    String payloadString = "";
-    for (unsigned int i=0; i<length; i++) {
-      payloadString += (char)payload[i];
-    }
-
-    if (payloadString == "true") {
-      drd->stop();
-      ESP.restart();
-    }
+  if (strncmp(topic, deviceTopic, deviceTopicLength) != 0 || topic[deviceTopicLength] != '/') {
+    return;
   }
 
-  if (queue.count() > maxQueueCount) {
-    #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-      Serial.println(F("Error: Send queue is full!"));
-    #endif
-    return;
+  const char* property = topic + deviceTopicLength + 1;
+  const uint32_t hash = hashString(property);
+  for (size_t i = 0; i < messageRouteCount; i++) {
+    if (messageRouteHashes[i] == hash && strcmp(messageRoutes[i].property, property) == 0) {
+      messageRoutes[i].handler(payload, length);
+      return;
+    }
   }
+}
 
-  StaticJsonDocument<255> doc;
-  DeserializationError error = deserializeJson(doc, payload, length);
-  JsonObject json = doc.as<JsonObject>();
+// Writes parent/name into topic
+void buildTopic(char* topic, const char* parent, const char* name) {
+  snprintf(topic, maxTopicLength, "%s/%s", parent, name);
+}
 
-  #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-    Serial.print(F("json: "));
-    serializeJson(doc, Serial);
-    Serial.println();
-  #endif
-  
-  if (error) {
-    #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-      Serial.print(F("deserializeJson() failed: "));
-      Serial.println(error.c_str());
-    #endif
-    return;
-  }
+void buildTopics() {
+  deviceTopicLength = snprintf(deviceTopic, maxTopicLength, "homie/%s", hostnameLowerCase);
+  buildTopic(willTopic, deviceTopic, "$state");
+  buildTopic(subscribeTopic, deviceTopic, "+/+/set");
+  buildTopic(fingerprintTopic, deviceTopic, "$fingerprint");
+
+  buildTopic(systemNodeTopic, deviceTopic, "system");
+  buildTopic(senderNodeTopic, deviceTopic, "sender");
+  buildTopic(receiverNodeTopic, deviceTopic, "receiver");
+
+  buildTopic(rssiPropertyTopic, systemNodeTopic, "rssi");
+  buildTopic(statsPropertyTopic, systemNodeTopic, "stats");
+  buildTopic(logPropertyTopic, systemNodeTopic, "log");
+  buildTopic(resetPropertyTopic, systemNodeTopic, "reset");
+
+  buildTopic(sendTypeAPropertyTopic, senderNodeTopic, "sendtypea");
+  buildTopic(sendPropertyTopic, senderNodeTopic, "send");
+  buildTopic(sendBatchPropertyTopic, senderNodeTopic, "sendbatch");
+  buildTopic(sendBinPropertyTopic, senderNodeTopic, "sendbin");
+
+  buildTopic(queueLengthPropertyTopic, receiverNodeTopic, "queuelength");
+  buildTopic(codeReceivedPropertyTopic, receiverNodeTopic, "codereceived");
+  buildTopic(codeAgePropertyTopic, receiverNodeTopic, "codeage");
+  buildTopic(capturePropertyTopic, receiverNodeTopic, "capture");
+  buildTopic(captureDataPropertyTopic, receiverNodeTopic, "capturedata");
+  buildTopic(dedupPropertyTopic, receiverNodeTopic, "dedup");
+  buildTopic(pressPropertyTopic, receiverNodeTopic, "press");
+  buildTopic(calibrationPropertyTopic, receiverNodeTopic, "calibration");
+  buildTopic(protocolsPropertyTopic, receiverNodeTopic, "protocols");
+  buildTopic(learnPropertyTopic, receiverNodeTopic, "learn");
+  buildTopic(learnedPropertyTopic, receiverNodeTopic, "learned");
+}
 
-  if (topicString == sendTypeASetPropertyTopic) {
-    //example request: {"group": "11111", "device": "11111", "repeatTransmit": 5, "switchOnOff": true}
+// Derives everything that depends on the configuration, after it was read or changed
+void applyConfig() {
+  toLower(hostnameLowerCase, hostname);
+  buildTopics();
+}
 
-    if (!json.containsKey("group") || !json.containsKey("device") || !json.containsKey("repeatTransmit") || !json.containsKey("repeatTransmit")) {
-      #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-        Serial.println(F("Values missing!"));
-      #endif
-      return;
+// CRC-32 (IEEE 802.3) of the boot cache
+uint32_t crc32(const uint8_t* data, size_t length) {
+  uint32_t crc = 0xFFFFFFFF;
+  while (length-- > 0) {
+    crc ^= *data++;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
     }
-    
-    String group = json["group"];
-    String device = json["device"];
-    int repeatTransmit = json["repeatTransmit"];
-    bool switchOnOff = json["switchOnOff"];
+  }
+  return ~crc;
+}
 
-    char* sCodeWord = mySwitch.getCodeWordA(group.c_str(), device.c_str(), switchOnOff);
-    unsigned long code = 0;
-    unsigned int length = 0;
-    mySwitch.triStateGetCodeAndLength(sCodeWord, code, length);
+uint32_t bootCacheCrc() {
+  return crc32((const uint8_t*) &bootCache, offsetof(BootCache, crc));
+}
 
-    CodeQueueItem *item = new CodeQueueItem();
+// Restores the configuration of the last boot, false if there is no valid copy
+bool readBootCache() {
+  if (bootCache.magic != bootCacheMagic || bootCache.crc != bootCacheCrc()) {
+    return false;
+  }
 
-    item->code = code;
-    item->length = length;
-    item->protocol = 1;
-    item->repeatTransmit = repeatTransmit;
+  memcpy(hostname, bootCache.hostname, sizeof(hostname));
+  memcpy(mqtt_server, bootCache.mqttServer, sizeof(mqtt_server));
+  memcpy(mqtt_port, bootCache.mqttPort, sizeof(mqtt_port));
+  custom_hostname.setValue(hostname, 40);
+  custom_mqtt_server.setValue(mqtt_server, 40);
+  custom_mqtt_port.setValue(mqtt_port, 6);
 
-    queue.push(*item);
+  #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+    Serial.println(F("config restored from RTC memory"));
+  #endif
+  return true;
+}
 
-    // Send message to main topic to confirm message received
-    mqttClient.publish(sendTypeAPropertyTopic.c_str(), payload, length, true);
+// Keeps the configuration and the current Wi-Fi connection for the next boot
+void writeBootCache() {
+  memset(&bootCache, 0, sizeof(bootCache));
+  memcpy(bootCache.hostname, hostname, sizeof(hostname));
+  memcpy(bootCache.mqttServer, mqtt_server, sizeof(mqtt_server));
+  memcpy(bootCache.mqttPort, mqtt_port, sizeof(mqtt_port));
+
+  memcpy(bootCache.bssid, WiFi.BSSID(), sizeof(bootCache.bssid));
+  bootCache.channel = WiFi.channel();
+  bootCache.localIP = WiFi.localIP();
+  bootCache.gatewayIP = WiFi.gatewayIP();
+  bootCache.subnetMask = WiFi.subnetMask();
+  bootCache.dnsIP = WiFi.dnsIP();
+  // Counted up to the next update of handleBootCacheAddress(), so a crash loop reaches the limit as well
+  bootCache.staticAddressTime = staticAddress ? staticAddressBase + millis() + staticAddressInterval : 0;
+  bootCache.customProtocols = customProtocols;
+
+  bootCache.magic = bootCacheMagic;
+  bootCache.crc = bootCacheCrc();
+}
 
-    #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-      Serial.print(F("sendtypea added to queue, group: "));
-      Serial.print(group);
-      Serial.print(F(" device: "));
-      Serial.print(device);
-      Serial.print(F(" repeatTransmit: "));
-      Serial.print(repeatTransmit);
-      Serial.print(F(" switch: "));
-      Serial.println(switchOnOff);
-    #endif
-  } else if (topicString == sendSetPropertyTopic) {
-    //example request: {"code": 1234, "codeLength": 24, "protocol": 1, "repeatTransmit": 5 }
+void invalidateBootCache() {
+  bootCache.magic = 0;
+}
 
-    if (!json.containsKey("code") || !json.containsKey("codeLength") || !json.containsKey("protocol") || !json.containsKey("repeatTransmit")) {
-      #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-        Serial.println(F("Values missing!"));
-      #endif
-      return;
+// Keeps the address of the connection for the next fast boot. Counts the
+// time on the cached address once a minute and asks DHCP for a lease once it
+// was used for maxStaticAddressTime, the connection then drops until DHCP
+// answered and MQTT reconnects.
+void handleBootCacheAddress() {
+  if (wifiLeaseChanged) {
+    wifiLeaseChanged = false;
+    if (bootCache.magic == bootCacheMagic) {
+      writeBootCache();
     }
-    
-    int code = json["code"];
-    int codeLength = json["codeLength"];
-    int protocol = json["protocol"];
-    int repeatTransmit = json["repeatTransmit"];
-
-    CodeQueueItem *item = new CodeQueueItem();
+  }
+  if (!staticAddress || (unsigned long)(millis() - staticAddressTimer) < staticAddressInterval) {
+    return;
+  }
+  staticAddressTimer = millis();
 
-    item->code = code;
-    item->length = codeLength;
-    item->protocol = protocol;
-    item->repeatTransmit = repeatTransmit;
+  const unsigned long used = staticAddressBase + millis();
+  if (used >= maxStaticAddressTime) {
+    #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+      Serial.println(F("Cached address expired, switching to DHCP"));
+    #endif
+    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+    staticAddress = false;
+  }
 
-    queue.push(*item);
+  if (bootCache.magic == bootCacheMagic) {
+    // Up to the next update, like writeBootCache(). Past maxStaticAddressTime
+    // the next fast boot asks DHCP as well, the lease may bring another address
+    bootCache.staticAddressTime = used + staticAddressInterval;
+    bootCache.crc = bootCacheCrc();
+  }
+}
 
-    // Send message to main topic to confirm message received
-    mqttClient.publish(sendPropertyTopic.c_str(), payload, length, true);
+// Publishes a new protocol table once the RF task uses it and keeps it for a software reset
+void handleProtocols() {
+  if (!protocolsChanged || RCSwitch::isLoadingProtocols() || !mqttClient.connected()) {
+    return;
+  }
+  protocolsChanged = false;
+  // sendtypea uses the new number from now on, the RF task swapped the table in
+  typeAProtocol = loadedTypeAProtocol;
 
-    #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-      Serial.print(F("send added to queue, code: "));
-      Serial.print(code);
-      Serial.print(F(" codeLength: "));
-      Serial.print(codeLength);
-      Serial.print(F(" protocol: "));
-      Serial.print(protocol);
-      Serial.print(F(" repeatTransmit: "));
-      Serial.println(repeatTransmit);
-    #endif
+  if (bootCache.magic == bootCacheMagic && bootCache.customProtocols != customProtocols) {
+    bootCache.customProtocols = customProtocols;
+    bootCache.crc = bootCacheCrc();
   }
+  publishProtocols();
 }
 
 void saveParamsCallback () {
@@ -389,6 +1858,9 @@ void saveParamsCallback () {
   strcpy(hostname, custom_hostname.getValue());
   strcpy(mqtt_server, custom_mqtt_server.getValue());
   strcpy(mqtt_port, custom_mqtt_port.getValue());
+  applyConfig();
+  // The next boot has to read the new configuration
+  invalidateBootCache();
 
   //save the custom parameters to FS
   #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
@@ -401,7 +1873,7 @@ void saveParamsCallback () {
   doc[MQTT_SERVER_ID] = mqtt_server;
   doc[MQTT_PORT_ID] = mqtt_port;
 
-  File configFile = SPIFFS.open("/config.json", "w");
+  File configFile = initSPIFFS() ? SPIFFS.open("/config.json", "w") : File();
   if (!configFile) {
     #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
       Serial.println(F("failed to open config file for writing"));
@@ -464,52 +1936,8 @@ void readConfig() {
       }
 
       configFile.close();
-
-      toLower(hostnameLowerCase, hostname);
-
-      deviceTopic = String("homie/") + hostnameLowerCase;
-      willTopic = deviceTopic + String("/$state");
-
-      systemNodeTopic = deviceTopic + "/system";
-      senderNodeTopic = deviceTopic + "/sender";
-      receiverNodeTopic = deviceTopic + "/receiver";
-
-      rssiPropertyTopic = systemNodeTopic + "/rssi";
-      logPropertyTopic = systemNodeTopic + "/log";
-      resetPropertyTopic = systemNodeTopic + String("/reset");
-      resetSetPropertyTopic = resetPropertyTopic + String("/set");
-
-      sendTypeAPropertyTopic = senderNodeTopic + "/sendtypea";
-      sendTypeASetPropertyTopic = sendTypeAPropertyTopic + "/set";
-      sendPropertyTopic = senderNodeTopic + "/send";
-      sendSetPropertyTopic = sendPropertyTopic + "/set";
-
-      queueLengthPropertyTopic = receiverNodeTopic + "/queuelength";
-      codeReceivedPropertyTopic = receiverNodeTopic + "/codereceived";
-    }
-  }
-}
-
-bool initSPIFFS() {
-  #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-    Serial.println(F("mounting FS..."));
-  #endif
-
-  if (!SPIFFS.begin()) {
-    #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-      Serial.println(F("Formatting FS..."));
-    #endif
-    SPIFFS.format();
-
-    if (!SPIFFS.begin()) {
-      return false;
     }
   }
-
-  #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-    Serial.println(F("mounted file system"));
-  #endif
-  return true;
 }
 
 void setupOTA() {
@@ -569,69 +1997,131 @@ void setupOTA() {
   ArduinoOTA.begin();
 }
 
-#if defined(HOMIE_DISCOVERY) && HOMIE_DISCOVERY
-void sendHomieDiscovery() {
-  mqttClient.publish((rssiPropertyTopic + "/$name").c_str(), "Wifi RSSI", true);
-  mqttClient.publish((rssiPropertyTopic + "/$unit").c_str(), "dB", true);
-  mqttClient.publish((rssiPropertyTopic + "/$datatype").c_str(), "integer", true);
-  mqttClient.publish((rssiPropertyTopic + "/$format").c_str(), "-100:0", true);
+// Reports the room of the send queues to submitCodes(). A preemptable code
+// on air keeps a slot of its queue, it may be queued again.
+void publishQueueRoom(const unsigned long* taken) {
+  const int onAir = preemptablePriority(mySwitch);
+  for (unsigned int priority = 0; priority < priorityCount; priority++) {
+    const unsigned int used = scheduler.count(priority) + ((int) priority == onAir ? 1 : 0);
+    radioQueueRoom[priority] = (used < maxQueueCount) ? maxQueueCount - used : 0;
+  }
+  SPSCQUEUE_MEMORY_BARRIER();
+  for (unsigned int priority = 0; priority < priorityCount; priority++) {
+    radioTakenCodes[priority] = taken[priority];
+  }
+}
+
+void rfTask(void* parameter) {
+  // Commands per class taken from radioCommands
+  unsigned long taken[priorityCount] = { 0 };
+
+  for (;;) {
+    const unsigned long start = micros();
+
+    if (!otaUpdateRunning) {
+      // submitCodes() made sure these fit
+      CodeQueueItem item;
+      while (radioCommands.pop(item)) {
+        taken[item.priority]++;
+        if (!scheduler.push(item)) {
+          #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+            Serial.println(F("Error: Send queue is full!"));
+          #endif
+        }
+      }
 
-  mqttClient.publish((logPropertyTopic + "/$name").c_str(), "Debug log", true);
-  mqttClient.publish((logPropertyTopic + "/$datatype").c_str(), "string", true);
-  mqttClient.publish((logPropertyTopic + "/$retained").c_str(), "false", true);
+      dispatchReceivedCodes(mySwitch, forwardReceivedCode);
+      sendQueuedCode(mySwitch);
+      radioQueueLength = scheduler.count();
+      publishQueueRoom(taken);
+    }
+
+    rfTaskTime.busyMicros += micros() - start;
+    // Edges wait in the buffer of RCSwitch meanwhile, sending runs from the timer interrupt
+    vTaskDelay(1);
+  }
+}
 
-  mqttClient.publish((resetPropertyTopic + "/$name").c_str(), "Reset controller", true);
-  mqttClient.publish((resetPropertyTopic + "/$datatype").c_str(), "boolean", true);
-  mqttClient.publish((resetPropertyTopic + "/$settable").c_str(), "true", true);
+void networkTask(void* parameter) {
+  for (;;) {
+    const unsigned long start = micros();
 
-  mqttClient.publish((systemNodeTopic + "/$name").c_str(), "System", true);
-  mqttClient.publish((systemNodeTopic + "/$properties").c_str(), "rssi,log,reset", true);
+    if (!otaUpdateRunning) checkAndConnectWifi();
+    if (!otaUpdateRunning) handleBootCacheAddress();
+    if (!otaUpdateRunning) checkAndConnectMqtt();
 
-  mqttClient.publish((sendTypeAPropertyTopic + "/$name").c_str(), "Send type a signal", true);
-  mqttClient.publish((sendTypeAPropertyTopic + "/$datatype").c_str(), "string", true);
-  mqttClient.publish((sendTypeAPropertyTopic + "/$settable").c_str(), "true", true);
+    RCSwitch::ReceivedCode code;
+    while (radioEvents.pop(code)) {
+      // Only the first frame of a press is published
+      if (receiveDedup.receive(code)) {
+        queueReceivedCode(code);
+      }
+    }
+    receiveDedup.handleEndedPresses(millis());
+    if (!otaUpdateRunning) flushEvents();
+    if (!otaUpdateRunning) handleCapture();
 
-  mqttClient.publish((sendPropertyTopic + "/$name").c_str(), "Send signal", true);
-  mqttClient.publish((sendPropertyTopic + "/$datatype").c_str(), "string", true);
-  mqttClient.publish((sendPropertyTopic + "/$settable").c_str(), "true", true);
+    #if defined(HOMIE_DISCOVERY) && HOMIE_DISCOVERY
+      if (!otaUpdateRunning && mqttClient.connected()) handleHomieDiscovery();
+    #endif
 
-  mqttClient.publish((senderNodeTopic + "/$name").c_str(), "Sender", true);
-  mqttClient.publish((senderNodeTopic + "/$properties").c_str(), "sendtypea,send", true);
+    if (!otaUpdateRunning) publishQueueLength();
+    if (!otaUpdateRunning) handleProtocols();
+    if (!otaUpdateRunning) handleSettings();
 
-  mqttClient.publish((queueLengthPropertyTopic + "/$name").c_str(), "Sender queue length", true);
-  mqttClient.publish((queueLengthPropertyTopic + "/$datatype").c_str(), "integer", true);
+    if (!otaUpdateRunning && (unsigned long)(millis() - rssiTimer) >= rssiTimeout) {
+      // Send RSSI and statistics
+      rssiTimer = millis();
+      sendRSSI();
+      sendStats();
+      publishCalibration();
+    }
 
-  mqttClient.publish((codeReceivedPropertyTopic + "/$name").c_str(), "Code received event", true);
-  mqttClient.publish((codeReceivedPropertyTopic + "/$datatype").c_str(), "integer", true);
-  mqttClient.publish((codeReceivedPropertyTopic + "/$retained").c_str(), "false", true);
+    if (!otaUpdateRunning) mqttClient.loop();
+    if (!otaUpdateRunning) drd->loop();
+    ArduinoOTA.handle();
 
-  mqttClient.publish((receiverNodeTopic + "/$name").c_str(), "Receiver", true);
-  mqttClient.publish((receiverNodeTopic + "/$properties").c_str(), "queuelength,codereceived", true);
+    networkTaskTime.busyMicros += micros() - start;
+    vTaskDelay(1);
+  }
+}
 
-  mqttClient.publish((deviceTopic + "/$homie").c_str(), "4.0", true);
-  mqttClient.publish((deviceTopic + "/$name").c_str(), hostname, true);
-  mqttClient.publish((deviceTopic + "/$nodes").c_str(), "system,sender,receiver", true);
-  mqttClient.publish((deviceTopic + "/$implementation").c_str(), "ESP32", true);
-  mqttClient.publish((deviceTopic + "/$extensions").c_str(), "", true);
-  mqttClient.publish(willTopic.c_str(), "ready", true);
+void startTasks() {
+  taskTimeTimer = micros();
+  xTaskCreatePinnedToCore(rfTask, "rf", rfTaskStackSize, NULL, rfTaskPriority, NULL, rfTaskCore);
+  xTaskCreatePinnedToCore(networkTask, "network", networkTaskStackSize, NULL, networkTaskPriority, NULL, networkTaskCore);
 }
-#endif
 
 void setup() {
   #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
     Serial.begin(115200);
+    // Time to attach the serial monitor
+    delay(1000);
   #else
     wifiManager.setDebugOutput(false);
   #endif
 
-  delay(1000);
-
   pinMode(LED_BUILTIN, OUTPUT);
 
+  initMessageRoutes();
   mqttClient.setCallback(messageReceived);
-
-  if (initSPIFFS()) {
-    readConfig();
+  // Room for a full capture batch or a send batch
+  mqttClient.setBufferSize(mqttBufferSize);
+
+  // After a software reset the configuration is still in RTC memory, SPIFFS is only read after power on
+  fastBoot = readBootCache();
+  if (fastBoot || initSPIFFS()) {
+    if (!fastBoot) {
+      readConfig();
+    }
+    applyConfig();
+    // SPIFFS is only needed on a fast boot if the protocol table was replaced
+    if (!fastBoot || bootCache.customProtocols) {
+      customProtocols = readProtocolsFile();
+      // no command is received before the RF task uses the table
+      typeAProtocol = loadedTypeAProtocol;
+    }
+    bootTimes[BOOT_CONFIG] = millis();
 
     drd = new DoubleResetDetector(DRD_TIMEOUT, DRD_ADDRESS);
 
@@ -659,19 +2149,36 @@ void setup() {
     } else {
       mySwitch.enableReceive(receivePin);
       mySwitch.enableTransmit(transmitPin);
-      mySwitch.setProtocol(2);
+      // The second built-in protocol by definition, a loaded table may number it differently
+      RCSwitch::Protocol defaultProtocol;
+      RCSwitch::getBuiltInProtocol(2, defaultProtocol);
+      mySwitch.setProtocol(defaultProtocol);
       mySwitch.setRepeatTransmit(5);
 
-      if (autoConnectWifi()) {
-        readConfig(); // Read config again in case something changed in the portal.
+      // A portal opened by autoConnectWifi() applies its changes in saveParamsCallback()
+      if (connectCachedWifi() || autoConnectWifi()) {
+        bootTimes[BOOT_WIFI] = millis();
+        writeBootCache();
+
         checkAndConnectMqtt();
+        bootTimes[BOOT_MQTT] = millis();
         setupOTA();
 
-        #if defined(HOMIE_DISCOVERY) && HOMIE_DISCOVERY
-          sendHomieDiscovery();
+        #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
+          Serial.print(fastBoot ? F("Fast boot") : F("Boot"));
+          Serial.print(F(" times (ms) config: "));
+          Serial.print(bootTimes[BOOT_CONFIG]);
+          Serial.print(F(" wifi: "));
+          Serial.print(bootTimes[BOOT_WIFI]);
+          Serial.print(F(" mqtt: "));
+          Serial.println(bootTimes[BOOT_MQTT]);
         #endif
 
-        mqttClient.publish(logPropertyTopic.c_str(), "Startup");
+        mqttClient.publish(logPropertyTopic, "Startup");
+        // the settings are published by the network task once MQTT is connected
+        receiveDedup.setHoldOff(defaultHoldOff);
+
+        startTasks();
       } else {
         ESP.restart();
       }
@@ -680,70 +2187,6 @@ void setup() {
 }
 
 void loop() {
-  if (!otaUpdateRunning) checkAndConnectWifi();
-  if (!otaUpdateRunning) checkAndConnectMqtt();
-
-  if (!otaUpdateRunning && mySwitch.available()) {
-    unsigned long value = mySwitch.getReceivedValue();
-    if (value == 0) {
-      #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-        Serial.println(F("Unknown encoding"));
-      #endif
-    } else {
-      mqttClient.publish(codeReceivedPropertyTopic.c_str(), String(value).c_str());
-      #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-        Serial.print(F("code received "));
-        Serial.println(value);
-      #endif
-    }
-    mySwitch.resetAvailable();
-  }
-
-  if (!otaUpdateRunning && !queue.isEmpty()) {
-    CodeQueueItem item = queue.pop();
-
-    #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-      Serial.print(F("sending code: "));
-      Serial.print(item.code);
-      Serial.print(F(" length: "));
-      Serial.print(item.length);
-      Serial.print(F(" protocol: "));
-      Serial.print(item.protocol);
-      Serial.print(F(" repeatTransmit: "));
-      Serial.println(item.repeatTransmit);
-    #endif
-
-    mySwitch.setProtocol(item.protocol);
-    mySwitch.setRepeatTransmit(item.repeatTransmit);
-    mySwitch.send(item.code, item.length);
-
-    #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-      Serial.print(F("sent code: "));
-      Serial.print(item.code);
-      Serial.print(F(" length: "));
-      Serial.print(item.length);
-      Serial.print(F(" protocol: "));
-      Serial.print(item.protocol);
-      Serial.print(F(" repeatTransmit: "));
-      Serial.println(item.repeatTransmit);
-    #endif
-
-    int queueCount = queue.count();
-    mqttClient.publish(queueLengthPropertyTopic.c_str(), String(queueCount).c_str(), true);
-
-    #if defined(RC_SWITCH_DEBUG) && RC_SWITCH_DEBUG
-      Serial.print(F("Queue count: "));
-      Serial.println(queueCount);
-    #endif
-  }
-
-  if (!otaUpdateRunning && (unsigned long)(millis() - rssiTimer) >= rssiTimeout) {
-    // Send RSSI
-    rssiTimer = millis();
-    sendRSSI();
-  }
-
-  if (!otaUpdateRunning) mqttClient.loop();
-  if (!otaUpdateRunning) drd->loop();
-  ArduinoOTA.handle();
+  // All work runs in rfTask() and networkTask()
+  vTaskDelete(NULL);
 }